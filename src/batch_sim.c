@@ -0,0 +1,198 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch_sim.h"
+
+// lanes stepped together until all of them are done, sized to stay in L1/L2
+#define BATCH_BLOCK 1024
+#define BATCH_ALIGN 64
+#define BATCH_ARRAYS 12
+
+uint32_t BatchSim_errorThreshold(double error_rate) {
+    if (error_rate <= 0) return 0;
+    if (error_rate >= 1) return UINT32_MAX;
+
+    return (uint32_t) (error_rate * 4294967296.0);
+}
+
+uint64_t BatchSim_gameSeed(uint64_t seed, size_t session) {
+    return Rng_mix(seed + RNG_GAMMA * (2 * (uint64_t) session + 1));
+}
+
+uint64_t BatchSim_playerSeed(uint64_t seed, size_t session) {
+    return Rng_mix(seed + RNG_GAMMA * (2 * (uint64_t) session + 2));
+}
+
+static void *carve(char **pos, size_t size) {
+    void *result = *pos;
+
+    *pos += (size + BATCH_ALIGN - 1) & ~(size_t) (BATCH_ALIGN - 1);
+
+    return result;
+}
+
+bool BatchSim_init(BatchSim *sim, size_t count, uint64_t seed,
+    double error_rate_min, double error_rate_max) {
+    size_t array_size = (count * sizeof(uint64_t) + BATCH_ALIGN - 1) & ~(size_t) (BATCH_ALIGN - 1);
+    double error_rate;
+    char *pos;
+    size_t i;
+
+    sim->storage = aligned_alloc(BATCH_ALIGN, BATCH_ARRAYS * array_size);
+    if (sim->storage == NULL) return false;
+
+    pos = (char *) sim->storage;
+    sim->count = count;
+    sim->state = (uint64_t *) carve(&pos, array_size);
+    sim->sequence_len = (uint64_t *) carve(&pos, array_size);
+    sim->cur_sequence_index = (uint64_t *) carve(&pos, array_size);
+    sim->error_threshold = (uint64_t *) carve(&pos, array_size);
+    sim->best_round = (uint64_t *) carve(&pos, array_size);
+    sim->game_seed = (uint64_t *) carve(&pos, array_size);
+    sim->player_seed = (uint64_t *) carve(&pos, array_size);
+    sim->presses = (uint64_t *) carve(&pos, array_size);
+    sim->games = (uint64_t *) carve(&pos, array_size);
+    sim->transitions = (uint64_t *) carve(&pos, array_size);
+    sim->rounds_total = (uint64_t *) carve(&pos, array_size);
+    sim->now = (int64_t *) carve(&pos, array_size);
+
+    for (i = 0; i < count; i++) {
+        error_rate = count > 1 ?
+            error_rate_min + (error_rate_max - error_rate_min) * i / (count - 1) :
+            error_rate_min;
+
+        // as main.c leaves a station after entering state_reset_game
+        sim->state[i] = state_start_playback_mode;
+        sim->sequence_len[i] = 1;
+        sim->cur_sequence_index[i] = 0;
+        sim->error_threshold[i] = BatchSim_errorThreshold(error_rate);
+        sim->best_round[i] = 0;
+        sim->game_seed[i] = BatchSim_gameSeed(seed, i);
+        sim->player_seed[i] = BatchSim_playerSeed(seed, i);
+        sim->presses[i] = 0;
+        sim->games[i] = 0;
+        sim->transitions[i] = 1;
+        sim->rounds_total[i] = 0;
+        sim->now[i] = 0;
+    }
+
+    return true;
+}
+
+// all ones when cond holds, else zero
+static inline uint64_t mask(uint64_t cond) {
+    return -cond;
+}
+
+static inline uint64_t pick(uint64_t mask, uint64_t if_set, uint64_t if_clear) {
+    return (if_set & mask) | (if_clear & ~mask);
+}
+
+// Advances every lane in [begin, end) that has not finished its games by one
+// input or timer expiry, and returns how many lanes are still playing. Each
+// lane computes the outcome of every state and masks in the one it is in, so
+// the loop body has no branches.
+static size_t stepBlock(BatchSim *sim, const BatchPlayer *player,
+    size_t begin, size_t end, uint64_t games) {
+    uint64_t *state = sim->state;
+    uint64_t *sequence_len = sim->sequence_len;
+    uint64_t *cur_sequence_index = sim->cur_sequence_index;
+    const uint64_t *error_threshold = sim->error_threshold;
+    uint64_t *best_round = sim->best_round;
+    const uint64_t *player_seed = sim->player_seed;
+    uint64_t *presses = sim->presses;
+    uint64_t *games_played = sim->games;
+    uint64_t *transitions = sim->transitions;
+    uint64_t *rounds_total = sim->rounds_total;
+    int64_t *now = sim->now;
+    uint64_t reaction_min = (uint64_t) player->reaction_min;
+    uint64_t reaction_spread = player->reaction_spread;
+    size_t playing = 0;
+    size_t i;
+
+    // the arrays are disjoint slices of one allocation
+#pragma GCC ivdep
+    for (i = begin; i < end; i++) {
+        uint64_t s = state[i];
+        uint64_t len = sequence_len[i];
+        uint64_t index = cur_sequence_index[i];
+        uint64_t draw = BatchPlayer_draw(player_seed[i], presses[i]);
+        uint64_t active = mask(games_played[i] < games);
+        uint64_t starting = mask(s == state_start_playback_mode);
+        uint64_t showing = mask(s == state_play_elem);
+        uint64_t pausing = mask(s == state_pause_elem);
+        uint64_t waiting = mask(s == state_wait_for_input);
+        uint64_t answered = mask(s == state_play_correct_choice);
+        uint64_t wrong = waiting & mask((draw >> 32) < error_threshold[i]);
+        uint64_t shows_next = pausing & mask(index < len);
+        // pause_elem with nothing left goes play_elem -> start_input_mode
+        // -> wait_for_input
+        uint64_t playback_done = pausing & ~shows_next;
+        uint64_t round_done = answered & mask(index + 1 >= len);
+        // a wrong press goes wait_for_input -> play_gameover -> reset_game
+        // -> start_playback_mode
+        uint64_t game_over = active & wrong;
+        uint64_t next_state, next_index, next_len, elapsed, reaction;
+
+        next_state =
+            (starting & state_play_elem) |
+            (showing & state_pause_elem) |
+            (shows_next & state_play_elem) |
+            (playback_done & state_wait_for_input) |
+            (wrong & state_start_playback_mode) |
+            ((waiting & ~wrong) & state_play_correct_choice) |
+            (round_done & state_start_playback_mode) |
+            ((answered & ~round_done) & state_wait_for_input);
+        reaction = reaction_min + (((draw & 0xffffffff) * reaction_spread) >> 32);
+        elapsed =
+            (starting & PRE_PLAYBACK_DELAY) |
+            (showing & PLAYBACK_ON_DURATION) |
+            (pausing & PLAYBACK_OFF_DURATION) |
+            (waiting & reaction) |
+            (answered & BATCH_PRESS_DURATION);
+        // play_elem shows an element, and counts it, on entry
+        next_index =
+            (starting & 1) |
+            (showing & index) |
+            (shows_next & (index + 1)) |
+            ((waiting & ~wrong) & index) |
+            ((answered & ~round_done) & (index + 1));
+        next_len = pick(wrong, 1, len + (round_done & 1));
+
+        state[i] = pick(active, next_state, s);
+        sequence_len[i] = pick(active, next_len, len);
+        cur_sequence_index[i] = pick(active, next_index, index);
+        now[i] += (int64_t) (active & elapsed);
+        transitions[i] += active & (((playback_done | wrong) & 2) | 1);
+        presses[i] += active & waiting & 1;
+        games_played[i] += game_over & 1;
+        rounds_total[i] += game_over & len;
+        best_round[i] = pick(game_over & mask(len > best_round[i]), len, best_round[i]);
+        playing += (games_played[i] < games);
+    }
+
+    return playing;
+}
+
+void BatchSim_run(BatchSim *sim, const BatchPlayer *player, uint64_t games) {
+    size_t begin, end, i;
+    uint64_t game;
+
+    for (begin = 0; begin < sim->count; begin = end) {
+        end = begin + BATCH_BLOCK < sim->count ? begin + BATCH_BLOCK : sim->count;
+        while (stepBlock(sim, player, begin, end, games) > 0);
+    }
+
+    // the sequence shown never changes the outcome for these players, so
+    // the kernel leaves seeds alone and they are caught up once at the end
+    for (i = 0; i < sim->count; i++) {
+        for (game = 0; game < sim->games[i]; game++) {
+            sim->game_seed[i] = Rng_nextSeed(sim->game_seed[i]);
+        }
+    }
+}
+
+void BatchSim_deinit(BatchSim *sim) {
+    free(sim->storage);
+}
@@ -0,0 +1,77 @@
+#ifndef BATCH_SIM_H
+#define BATCH_SIM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+#include "rng.h"
+
+// Many game sessions played by synthetic players at once. Sessions are kept
+// as structure-of-arrays and advanced one input or timer expiry at a time by
+// a branch-free kernel over blocks of lanes, so the compiler can vectorize
+// it. Only the states a session can wait in are kept; the ones main.c passes
+// straight through (reset, start of input, game over) are folded into the
+// step that enters them, with their transitions still counted. The kernel
+// needs -O3 (or -ftree-vectorize) and a SIMD target such as -march=native to
+// actually vectorize; without them it still runs, a little slower than
+// playing the sessions on the state machine.
+
+#define BATCH_PRESS_DURATION 150000000
+
+// a synthetic player: press k is wrong with the session's error rate and
+// comes a uniform reaction time in [reaction_min, reaction_min + spread)
+// after the station starts waiting
+typedef struct {
+    Nanoseconds reaction_min;
+    uint32_t reaction_spread;
+} BatchPlayer;
+
+typedef struct {
+    size_t count;
+    // all lanes are 64 bits wide so one vector covers the same sessions in
+    // every array
+    uint64_t *state;
+    uint64_t *sequence_len;
+    uint64_t *cur_sequence_index;
+    // wrong when the high half of a press draw is below it
+    uint64_t *error_threshold;
+    uint64_t *best_round;
+    // seed of the game in progress, only brought up to date by BatchSim_run
+    // once all games are done
+    uint64_t *game_seed;
+    uint64_t *player_seed;
+    uint64_t *presses;
+    uint64_t *games;
+    uint64_t *transitions;
+    uint64_t *rounds_total;
+    int64_t *now;
+    void *storage;
+} BatchSim;
+
+static inline uint64_t BatchPlayer_draw(uint64_t player_seed, uint64_t press) {
+    return Rng_mix(player_seed + RNG_GAMMA * (press + 1));
+}
+
+static inline bool BatchPlayer_wrong(uint64_t draw, uint32_t error_threshold) {
+    return (uint32_t) (draw >> 32) < error_threshold;
+}
+
+static inline Nanoseconds BatchPlayer_reaction(const BatchPlayer *player, uint64_t draw) {
+    return player->reaction_min + (Nanoseconds) (((draw & 0xffffffff) * player->reaction_spread) >> 32);
+}
+
+uint32_t BatchSim_errorThreshold(double error_rate);
+// seeds of session i, shared with the scalar check
+uint64_t BatchSim_gameSeed(uint64_t seed, size_t session);
+uint64_t BatchSim_playerSeed(uint64_t seed, size_t session);
+
+// error rates are spread evenly over [error_rate_min, error_rate_max]
+bool BatchSim_init(BatchSim *sim, size_t count, uint64_t seed,
+    double error_rate_min, double error_rate_max);
+// plays every session until it has finished games games
+void BatchSim_run(BatchSim *sim, const BatchPlayer *player, uint64_t games);
+void BatchSim_deinit(BatchSim *sim);
+
+#endif
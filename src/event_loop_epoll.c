@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "platform.h"
+
+// EventLoop for the backends whose input devices expose a pollable fd: a
+// single epoll set over every station's getInputFd, so one process can sleep
+// on all of them at once.
+
+typedef struct {
+    // NULL for a wakeup fd
+    InputDevice *dev;
+    void *ctx;
+} Watch;
+
+typedef struct EventLoop {
+    int epoll_fd;
+    Watch watches[MAX_STATIONS];
+    int watch_count;
+} EventLoop;
+
+EventLoop *initEventLoop(void) {
+    EventLoop *result_loop = NULL;
+
+    result_loop = (EventLoop *) malloc(sizeof(EventLoop));
+    if (result_loop == NULL) goto exit;
+
+    result_loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (result_loop->epoll_fd < 0) {
+        fprintf(stderr, "Failed to create epoll instance: %s\n", strerror(errno));
+        free(result_loop);
+        result_loop = NULL;
+        goto exit;
+    }
+    result_loop->watch_count = 0;
+
+exit:
+    return result_loop;
+}
+
+static bool addWatch(EventLoop *loop, int fd, InputDevice *dev, void *ctx) {
+    struct epoll_event event = { 0 };
+    Watch *watch;
+
+    if (loop->watch_count >= MAX_STATIONS) return false;
+
+    watch = &loop->watches[loop->watch_count];
+    watch->dev = dev;
+    watch->ctx = ctx;
+
+    event.events = EPOLLIN;
+    event.data.ptr = watch;
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        fprintf(stderr, "Failed to watch input device: %s\n", strerror(errno));
+        return false;
+    }
+    loop->watch_count++;
+
+    return true;
+}
+
+bool watchInput(EventLoop *loop, InputDevice *dev, void *ctx) {
+    return addWatch(loop, getInputFd(dev), dev, ctx);
+}
+
+bool watchWakeupFd(EventLoop *loop, int fd, void *ctx) {
+    return addWatch(loop, fd, NULL, ctx);
+}
+
+static bool allExhausted(EventLoop *loop) {
+    int i;
+
+    for (i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].dev == NULL || !inputExhausted(loop->watches[i].dev)) return false;
+    }
+
+    return true;
+}
+
+int waitForEvents(EventLoop *loop, Nanoseconds deadline, const sigset_t *wait_mask,
+    void **ready_out, int max_ready) {
+    struct epoll_event events[MAX_STATIONS];
+    struct timespec timeout = { 0 };
+    struct timespec *timeout_ptr = NULL;
+    Nanoseconds remaining;
+    int count, i;
+
+    // nothing could ever wake us up again
+    if (deadline == NO_DEADLINE && allExhausted(loop)) return -1;
+
+    if (deadline != NO_DEADLINE) {
+        remaining = deadline - nanoTimestamp();
+        if (remaining > 0) {
+            timeout.tv_sec = remaining / NS_PER_SEC;
+            timeout.tv_nsec = remaining % NS_PER_SEC;
+        }
+        timeout_ptr = &timeout;
+    }
+    if (max_ready > MAX_STATIONS) max_ready = MAX_STATIONS;
+
+    count = epoll_pwait2(loop->epoll_fd, events, max_ready, timeout_ptr, wait_mask);
+    if (count < 0) {
+        if (errno == EINTR) return 0;
+        fprintf(stderr, "Failed to wait for input: %s\n", strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        ready_out[i] = ((Watch *) events[i].data.ptr)->ctx;
+    }
+
+    return count;
+}
+
+void deinitEventLoop(EventLoop *loop) {
+    close(loop->epoll_fd);
+    free(loop);
+}
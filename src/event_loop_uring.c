@@ -0,0 +1,175 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "platform.h"
+#include "uring.h"
+
+// EventLoop on io_uring, for backends built with -DPLATFORM_URING. Devices
+// that keep their own reads armed on the ring report input through their
+// completions; any other fd gets a multishot poll. One io_uring_enter then
+// submits the output queued since the last wait, sleeps until input, a
+// completion or the next timer deadline, and reaps.
+
+typedef struct {
+    // first, so a completion leads back to its watch
+    UringOp op;
+    EventLoop *loop;
+    // NULL for a wakeup fd
+    InputDevice *dev;
+    int fd;
+    // a multishot poll is in flight; unused for devices with their own op
+    bool armed;
+} Watch;
+
+typedef struct EventLoop {
+    Watch watches[MAX_STATIONS];
+    int watch_count;
+    // cancelled and waited for on deinit, their completions point in here
+    int polls_armed;
+} EventLoop;
+
+EventLoop *initEventLoop(void) {
+    EventLoop *result_loop = NULL;
+
+    result_loop = (EventLoop *) malloc(sizeof(EventLoop));
+    if (result_loop == NULL) goto exit;
+
+    if (!Uring_init()) {
+        free(result_loop);
+        result_loop = NULL;
+        goto exit;
+    }
+    result_loop->watch_count = 0;
+    result_loop->polls_armed = 0;
+
+exit:
+    return result_loop;
+}
+
+static bool pollDone(UringOp *op, int32_t result, uint32_t flags) {
+    Watch *watch = (Watch *) op;
+
+    // the kernel ends a multishot poll on overflow or error; rearmed on
+    // the next wait
+    if (!(flags & IORING_CQE_F_MORE)) {
+        watch->armed = false;
+        watch->loop->polls_armed--;
+    }
+    if (result < 0) {
+        if (result != -ECANCELED) fprintf(stderr, "Failed to poll input: %s\n", strerror(-result));
+        return false;
+    }
+
+    return true;
+}
+
+static void armPoll(Watch *watch) {
+    struct io_uring_sqe *sqe;
+
+    sqe = Uring_prep(&watch->op, IORING_OP_POLL_ADD, watch->fd);
+    if (sqe == NULL) return;
+    sqe->poll32_events = POLLIN;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    watch->armed = true;
+    watch->loop->polls_armed++;
+}
+
+static bool addWatch(EventLoop *loop, int fd, InputDevice *dev, void *ctx) {
+    Watch *watch;
+    UringOp *dev_op;
+
+    if (loop->watch_count >= MAX_STATIONS) return false;
+
+    watch = &loop->watches[loop->watch_count];
+    watch->loop = loop;
+    watch->dev = dev;
+    watch->fd = fd;
+    watch->armed = false;
+    watch->op.complete = pollDone;
+    watch->op.ctx = ctx;
+
+    dev_op = dev != NULL ? uringInputOp(dev) : NULL;
+    if (dev_op != NULL) {
+        dev_op->ctx = ctx;
+    } else if (fd < 0) {
+        fprintf(stderr, "Failed to watch input device: no fd to poll\n");
+        return false;
+    } else {
+        armPoll(watch);
+    }
+    loop->watch_count++;
+
+    return true;
+}
+
+bool watchInput(EventLoop *loop, InputDevice *dev, void *ctx) {
+    return addWatch(loop, uringInputOp(dev) != NULL ? -1 : getInputFd(dev), dev, ctx);
+}
+
+bool watchWakeupFd(EventLoop *loop, int fd, void *ctx) {
+    return addWatch(loop, fd, NULL, ctx);
+}
+
+static bool allExhausted(EventLoop *loop) {
+    int i;
+
+    for (i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].dev == NULL || !inputExhausted(loop->watches[i].dev)) return false;
+    }
+
+    return true;
+}
+
+int waitForEvents(EventLoop *loop, Nanoseconds deadline, const sigset_t *wait_mask,
+    void **ready_out, int max_ready) {
+    struct timespec timeout = { 0 };
+    struct timespec *timeout_ptr = NULL;
+    Nanoseconds remaining;
+    int count, ret, i;
+
+    // nothing could ever wake us up again
+    if (deadline == NO_DEADLINE && allExhausted(loop)) return -1;
+
+    for (i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].fd >= 0 && !loop->watches[i].armed) armPoll(&loop->watches[i]);
+    }
+
+    // input left over from the last reap is handed out without sleeping;
+    // anything queued meanwhile goes with the next wait
+    count = Uring_reap(ready_out, max_ready);
+    if (count > 0) return count;
+
+    if (deadline != NO_DEADLINE) {
+        remaining = deadline - nanoTimestamp();
+        if (remaining > 0) {
+            timeout.tv_sec = remaining / NS_PER_SEC;
+            timeout.tv_nsec = remaining % NS_PER_SEC;
+        }
+        timeout_ptr = &timeout;
+    }
+
+    ret = Uring_wait(timeout_ptr, wait_mask);
+    if (ret < 0 && ret != -ETIME && ret != -EINTR && ret != -EBUSY) {
+        fprintf(stderr, "Failed to wait for input: %s\n", strerror(-ret));
+        return -1;
+    }
+
+    return Uring_reap(ready_out, max_ready);
+}
+
+void deinitEventLoop(EventLoop *loop) {
+    int i;
+
+    for (i = 0; i < loop->watch_count; i++) {
+        if (loop->watches[i].armed) Uring_cancel(&loop->watches[i].op);
+    }
+    Uring_waitFor(&loop->polls_armed);
+    Uring_deinit();
+    free(loop);
+}
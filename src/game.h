@@ -1,12 +1,38 @@
 #ifndef GAME_H
 #define GAME_H
 
-typedef enum {
-    choice_left,
-    choice_mid,
-    choice_right,
-    NUM_CHOICES,
-} Choice;
+#include <stdint.h>
+
+// A station has between 2 and MAX_CHOICES buttons, each with an LED and a
+// tone, set at startup. Choice n is the n-th of them; a ChoiceMask holds one
+// bit per choice, so a whole board is one 64-bit GPIO line request.
+#define MAX_CHOICES 64
+#define DEFAULT_CHOICE_COUNT 3
+// stations one process runs, and the room recordings, telemetry and traces
+// keep for them
+#define MAX_STATIONS 32
+
+typedef int Choice;
+typedef uint64_t ChoiceMask;
+
+static inline ChoiceMask Choice_bit(Choice choice) {
+    return (ChoiceMask) 1 << choice;
+}
+
+// every choice of a board with count of them
+static inline ChoiceMask ChoiceMask_all(int count) {
+    return count >= MAX_CHOICES ? ~(ChoiceMask) 0 : Choice_bit(count) - 1;
+}
+
+// pitch of the tone for a choice the config gives none for, in Hz: a
+// harmonic series from 440, so the first three make a major triad
+static inline int Choice_defaultFrequency(Choice choice) {
+    return 110 * (4 + choice);
+}
+
+// a point in time or a duration in nanoseconds; points in time are on the
+// clock nanoTimestamp reads
+typedef int64_t Nanoseconds;
 
 typedef enum {
     event_button_down,
@@ -16,6 +42,63 @@ typedef enum {
 typedef struct {
     EventType type;
     Choice choice;
+    // when the edge happened
+    Nanoseconds timestamp;
 } InputEvent;
 
+// step timings, states and signals of a game; main.c runs them,
+// batch_sim.c mirrors them
+#define PRE_PLAYBACK_DELAY 1000000000
+#define PLAYBACK_ON_DURATION 500000000
+#define PLAYBACK_OFF_DURATION 350000000
+
+typedef enum {
+    state_reset_game,
+    state_start_playback_mode,
+    state_play_elem,
+    state_pause_elem,
+    state_start_input_mode,
+    state_wait_for_input,
+    state_play_correct_choice,
+    state_play_gameover,
+    // dark, or stepping an attract animation, until a button is pressed
+    state_idle,
+    STATE_COUNT,
+} State;
+
+typedef enum {
+    signal_enter,
+    signal_exit,
+    signal_timeout,
+    signal_input,
+    SIGNAL_COUNT,
+} Signal;
+
+static inline const char *State_name(State state) {
+    static const char *const names[STATE_COUNT] = {
+        "reset_game",
+        "start_playback_mode",
+        "play_elem",
+        "pause_elem",
+        "start_input_mode",
+        "wait_for_input",
+        "play_correct_choice",
+        "play_gameover",
+        "idle",
+    };
+
+    return (unsigned) state < STATE_COUNT ? names[state] : "?";
+}
+
+static inline const char *Signal_name(Signal signal) {
+    static const char *const names[SIGNAL_COUNT] = {
+        "enter",
+        "exit",
+        "timeout",
+        "input",
+    };
+
+    return (unsigned) signal < SIGNAL_COUNT ? names[signal] : "?";
+}
+
 #endif
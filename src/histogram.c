@@ -0,0 +1,71 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+
+static int bucketIndex(uint64_t value) {
+    int msb, shift;
+
+    if (value < HISTOGRAM_SUB_BUCKETS) return (int) value;
+
+    msb = 63 - __builtin_clzll(value);
+    shift = msb - HISTOGRAM_SUB_BUCKET_BITS;
+
+    return (shift + 1) * HISTOGRAM_SUB_BUCKETS +
+        (int) ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+static int64_t bucketUpperBound(int index) {
+    int shift, sub_bucket;
+
+    if (index < HISTOGRAM_SUB_BUCKETS) return index;
+
+    shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    sub_bucket = index % HISTOGRAM_SUB_BUCKETS;
+
+    return (int64_t) (((uint64_t) (HISTOGRAM_SUB_BUCKETS + sub_bucket + 1) << shift) - 1);
+}
+
+void Histogram_init(Histogram *hist) {
+    memset(hist, 0, sizeof(*hist));
+}
+
+void Histogram_record(Histogram *hist, int64_t value) {
+    if (value < 0) value = 0;
+
+    hist->counts[bucketIndex((uint64_t) value)]++;
+    hist->total++;
+    if (value > hist->max) hist->max = value;
+}
+
+int64_t Histogram_percentile(const Histogram *hist, double percentile) {
+    uint64_t rank, seen = 0;
+    int64_t bound;
+    int i;
+
+    if (hist->total == 0) return 0;
+
+    rank = (uint64_t) (percentile / 100.0 * (double) hist->total + 0.5);
+    if (rank < 1) rank = 1;
+    if (rank > hist->total) rank = hist->total;
+
+    for (i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen >= rank) {
+            bound = bucketUpperBound(i);
+            return bound < hist->max ? bound : hist->max;
+        }
+    }
+
+    return hist->max;
+}
+
+void Histogram_print(const Histogram *hist, FILE *file, const char *name) {
+    fprintf(file, "%s: n=%llu p50=%.3fms p99=%.3fms max=%.3fms\n",
+        name,
+        (unsigned long long) hist->total,
+        Histogram_percentile(hist, 50.0) / 1e6,
+        Histogram_percentile(hist, 99.0) / 1e6,
+        hist->max / 1e6);
+}
@@ -0,0 +1,26 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Log-bucketed histogram of non-negative nanosecond values. Each power of
+// two is split into HISTOGRAM_SUB_BUCKETS linear buckets, so percentiles are
+// accurate to within 1/HISTOGRAM_SUB_BUCKETS of the value. Recording never
+// allocates.
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+typedef struct {
+    uint32_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    int64_t max;
+} Histogram;
+
+void Histogram_init(Histogram *hist);
+void Histogram_record(Histogram *hist, int64_t value);
+int64_t Histogram_percentile(const Histogram *hist, double percentile);
+void Histogram_print(const Histogram *hist, FILE *file, const char *name);
+
+#endif
@@ -0,0 +1,192 @@
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "input_capture.h"
+#include "realtime.h"
+
+#define CACHE_LINE 64
+
+struct InputCapture {
+    InputDevice *dev;
+    pthread_t thread;
+    // counts events pushed, the game loop waits on it
+    int wakeup_fd;
+    // written once to make the thread exit
+    int stop_fd;
+    // written only by the capture thread
+    _Alignas(CACHE_LINE) uint32_t head;
+    bool exhausted;
+    uint64_t dropped;
+    // written only by the game loop
+    _Alignas(CACHE_LINE) uint32_t tail;
+    Nanoseconds clear_before;
+    _Alignas(CACHE_LINE) InputEvent ring[INPUT_CAPTURE_RING_SIZE];
+};
+
+static void wakeUp(int fd) {
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static bool push(InputCapture *capture, const InputEvent *ev) {
+    uint32_t head = capture->head;
+    uint32_t tail = __atomic_load_n(&capture->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == INPUT_CAPTURE_RING_SIZE) {
+        capture->dropped++;
+        return false;
+    }
+
+    capture->ring[head & (INPUT_CAPTURE_RING_SIZE - 1)] = *ev;
+    __atomic_store_n(&capture->head, head + 1, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static void *captureLoop(void *arg) {
+    InputCapture *capture = (InputCapture *) arg;
+    struct pollfd fds[2];
+    InputEvent ev;
+    bool pushed;
+
+    blockThreadSignals();
+
+    fds[0].fd = getInputFd(capture->dev);
+    fds[0].events = POLLIN;
+    fds[1].fd = capture->stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to wait for input: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0) break;
+
+        pushed = false;
+        while (pollInput(capture->dev, &ev)) {
+            pushed |= push(capture, &ev);
+        }
+        if (inputExhausted(capture->dev)) break;
+        if (pushed) wakeUp(capture->wakeup_fd);
+    }
+
+    __atomic_store_n(&capture->exhausted, true, __ATOMIC_RELEASE);
+    wakeUp(capture->wakeup_fd);
+
+    return NULL;
+}
+
+InputCapture *InputCapture_start(InputDevice *dev) {
+    InputCapture *result_capture = NULL;
+    int err;
+
+    if (getInputFd(dev) < 0) {
+        fprintf(stderr, "This backend's input can't be captured on a thread\n");
+        goto exit;
+    }
+
+    result_capture = (InputCapture *) aligned_alloc(CACHE_LINE, sizeof(InputCapture));
+    if (result_capture == NULL) goto exit;
+    memset(result_capture, 0, sizeof(InputCapture));
+    result_capture->dev = dev;
+    result_capture->clear_before = NO_DEADLINE;
+
+    result_capture->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (result_capture->wakeup_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto exit_free_capture;
+    }
+    result_capture->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (result_capture->stop_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto exit_close_wakeup;
+    }
+
+    err = pthread_create(&result_capture->thread, NULL, captureLoop, result_capture);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start input capture thread: %s\n", strerror(err));
+        goto exit_close_stop;
+    }
+
+    goto exit;
+
+exit_close_stop:
+    close(result_capture->stop_fd);
+
+exit_close_wakeup:
+    close(result_capture->wakeup_fd);
+
+exit_free_capture:
+    free(result_capture);
+    result_capture = NULL;
+
+exit:
+    return result_capture;
+}
+
+int InputCapture_fd(InputCapture *capture) {
+    return capture->wakeup_fd;
+}
+
+bool InputCapture_poll(InputCapture *capture, InputEvent *ev_out) {
+    uint32_t tail = capture->tail;
+    uint64_t count;
+
+    // reset the wakeup before looking, a push after this wakes us again
+    if (read(capture->wakeup_fd, &count, sizeof(count)) < 0) count = 0;
+
+    for (;;) {
+        if (tail == __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE)) return false;
+
+        *ev_out = capture->ring[tail & (INPUT_CAPTURE_RING_SIZE - 1)];
+        tail++;
+        __atomic_store_n(&capture->tail, tail, __ATOMIC_RELEASE);
+        if (ev_out->timestamp >= capture->clear_before) return true;
+    }
+}
+
+// lazily: older events are skipped as they are polled
+void InputCapture_clear(InputCapture *capture, Nanoseconds now) {
+    capture->clear_before = now;
+}
+
+bool InputCapture_exhausted(InputCapture *capture) {
+    return __atomic_load_n(&capture->exhausted, __ATOMIC_ACQUIRE) &&
+        capture->tail == __atomic_load_n(&capture->head, __ATOMIC_ACQUIRE);
+}
+
+bool InputCapture_setPriority(InputCapture *capture, int priority) {
+    struct sched_param param = { 0 };
+    int err;
+
+    param.sched_priority = priority;
+    err = pthread_setschedparam(capture->thread, SCHED_FIFO, &param);
+    if (err != 0) {
+        fprintf(stderr, "Failed to raise input capture priority to %d: %s\n", priority, strerror(err));
+        return false;
+    }
+
+    return true;
+}
+
+void InputCapture_stop(InputCapture *capture) {
+    wakeUp(capture->stop_fd);
+    pthread_join(capture->thread, NULL);
+    if (capture->dropped > 0) {
+        fprintf(stderr, "input capture dropped %llu events\n", (unsigned long long) capture->dropped);
+    }
+    close(capture->stop_fd);
+    close(capture->wakeup_fd);
+    free(capture);
+}
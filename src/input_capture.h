@@ -0,0 +1,32 @@
+#ifndef INPUT_CAPTURE_H
+#define INPUT_CAPTURE_H
+
+#include <stdbool.h>
+
+#include "game.h"
+#include "platform.h"
+
+// Reads an InputDevice on a dedicated thread, so edges are read and
+// timestamped as they arrive even while the game loop is stuck in a slow
+// output call. Events reach the game loop through a lock-free
+// single-producer/single-consumer ring; an eventfd wakes the loop up. Once
+// capture has started the device belongs to the capture thread.
+
+#define INPUT_CAPTURE_RING_SIZE 256
+
+typedef struct InputCapture InputCapture;
+
+// NULL if the device has no fd to block on or the thread can't start
+InputCapture *InputCapture_start(InputDevice *dev);
+// readable while captured events are waiting
+int InputCapture_fd(InputCapture *capture);
+bool InputCapture_poll(InputCapture *capture, InputEvent *ev_out);
+// drop events that happened before now
+void InputCapture_clear(InputCapture *capture, Nanoseconds now);
+// the device will never produce input again and the ring is empty
+bool InputCapture_exhausted(InputCapture *capture);
+// SCHED_FIFO priority for the capture thread, so it preempts the game loop
+bool InputCapture_setPriority(InputCapture *capture, int priority);
+void InputCapture_stop(InputCapture *capture);
+
+#endif
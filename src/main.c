@@ -1,59 +1,173 @@
 #include <assert.h>
 #include <errno.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "batch_sim.h"
 #include "game.h"
+#include "histogram.h"
+#include "input_capture.h"
 #include "platform.h"
+#include "realtime.h"
+#include "recorder.h"
+#include "rng.h"
+#include "score_store.h"
+#include "telemetry.h"
+#include "timer_queue.h"
+#include "trace.h"
 
-#define PRE_PLAYBACK_DELAY 1000000000
-#define PLAYBACK_ON_DURATION 500000000
-#define PLAYBACK_OFF_DURATION 350000000
-#define MAX_SEQUENCE_LEN 2000
-
+// which of the machine's timers a signal_timeout came from
 typedef enum {
-    state_reset_game,
-    state_start_playback_mode,
-    state_play_elem,
-    state_pause_elem,
-    state_start_input_mode,
-    state_wait_for_input,
-    state_play_correct_choice,
-    state_play_gameover,
-    STATE_COUNT,
-} State;
+    timer_step,
+    // no input for idle_after, the station goes idle
+    timer_idle,
+    timer_attract,
+    TIMER_TAG_COUNT,
+} TimerTag;
 
-typedef enum {
-    signal_enter,
-    signal_exit,
-    signal_timeout,
-    signal_input,
-    SIGNAL_COUNT,
-} Signal;
+#define NO_TONE -1
+
+#define DEFAULT_BATCH_GAMES 100
+#define DEFAULT_ERROR_RATE 0.05
+#define DEFAULT_REACTION_MIN_MS 250
+#define DEFAULT_REACTION_MAX_MS 600
+#define BATCH_SUMMARY_ROWS 10
+#define DEFAULT_IDLE_AFTER_S 60
+// less idle time than this gets counts in the stats, not rates
+#define IDLE_STATS_MIN_TIME NS_PER_SEC
+#define BENCH_DISPATCH_RUNS 5
+
+// what the LEDs and buzzer should show; handlers only edit this and the run
+// loop pushes it to the devices once per pass, when it has changed
+typedef struct {
+    ChoiceMask leds;
+    int tone;
+} Output;
 
 typedef struct {
-    time_t started_at;
-    time_t duration;
-    bool active;
-} Timer;
+    // seed of the first game; later games follow with Rng_nextSeed
+    uint64_t seed;
+    bool log_games;
+    bool realtime;
+    bool threaded_input;
+    int realtime_cpu;
+    int realtime_priority;
+    StationConfig stations[MAX_STATIONS];
+    int station_count;
+    const char *record_path;
+    const char *replay_path;
+    bool replay_real_time;
+    // batch simulation, off when batch_sessions is 0
+    uint64_t batch_sessions;
+    uint64_t batch_games;
+    double error_rate_min;
+    double error_rate_max;
+    int reaction_min_ms;
+    int reaction_max_ms;
+    bool batch_check;
+    // games per --bench-dispatch run, 0 when not benchmarking
+    uint64_t bench_games;
+    // 0 to never go idle
+    Nanoseconds idle_after;
+    // 0 to stay dark while idle
+    Nanoseconds attract_period;
+    // shared memory segment for monitors, NULL when not publishing
+    const char *telemetry_name;
+    // results of every game, NULL when not keeping them
+    const char *scores_path;
+#ifdef GAME_TRACE
+    const char *trace_path;
+#endif
+} Options;
 
 typedef struct {
+    int id;
     State state;
     LedsDevice *leds_dev;
     InputDevice *input_dev;
     SoundDevice *sound_dev;
-    Choice sequence[MAX_SEQUENCE_LEN];
-    int sequence_len;
-    int cur_sequence_index;
+    // reads input_dev on its own thread, NULL when input is read inline
+    InputCapture *capture;
+    // sequence elements are drawn from this many
+    int choice_count;
+    // the sequence itself is never stored, element i is regenerated from
+    // game_seed on demand by StateMachine_sequenceAt
+    uint64_t sequence_len;
+    uint64_t cur_sequence_index;
+    uint64_t game_seed;
+    uint64_t next_game_seed;
+    Nanoseconds game_started_at;
+    bool log_games;
+    // how long wait_for_input waits before going idle, 0 for forever
+    Nanoseconds idle_after;
+    // step of the attract animation, 0 to stay dark
+    Nanoseconds attract_period;
+    Choice attract_pos;
     InputEvent input_event;
-    Timer timer;
-    bool running;
+    Timer timers[TIMER_TAG_COUNT];
+    // shared by every station in the process
+    TimerQueue *timer_queue;
+    // tag of the timer behind the signal_timeout being handled
+    TimerTag timeout_tag;
+    // clock reading taken once per wakeup, timers are checked against it
+    Nanoseconds now;
+    // session log, NULL when not recording
+    Recorder *recorder;
+    // live counters for monitors, NULL when not publishing
+    Telemetry *telemetry;
+    // game results, NULL when not keeping them
+    ScoreStore *scores;
+    Output output;
+    Output committed_output;
+    StationStatus committed_status;
+    // measured by the engine, shown in the station status
+    uint64_t loop_rate;
+    // edge time of a press whose output has not been committed yet
+    Nanoseconds uncommitted_press_at;
+    // edge-to-output latency of every correct press
+    Histogram press_latency;
+    // how far each playElem/pauseElem step ran over or under its duration
+    Histogram step_jitter;
+    Nanoseconds step_started_at;
+    Nanoseconds step_duration;
+    unsigned long long transitions;
+    unsigned long long games_played;
+    uint64_t high_score;
+    uint64_t input_events;
+    uint64_t timeouts;
+    struct timespec started_at;
 } StateMachine;
 
+// Every station in the process: one EventLoop and one TimerQueue multiplex
+// all of their input and timers.
+typedef struct {
+    StateMachine *machines;
+    int machine_count;
+    EventLoop *loop;
+    Timer *timer_heap[MAX_STATIONS * TIMER_TAG_COUNT];
+    TimerQueue timer_queue;
+    Recorder *recorder;
+    Telemetry *telemetry;
+    ScoreStore *scores;
+    bool running;
+    // Spells with every station idle: when the current one started
+    // (NO_DEADLINE outside one) and the process CPU time then, and totals
+    // over all of them.
+    Nanoseconds idle_since;
+    Nanoseconds idle_cpu_since;
+    Nanoseconds idle_time;
+    Nanoseconds idle_cpu_time;
+    uint64_t idle_wakeups;
+} Engine;
+
 State resetGame(StateMachine *machine, Signal signal);
 State startPlaybackMode(StateMachine *machine, Signal signal);
 State playElem(StateMachine *machine, Signal signal);
@@ -62,9 +176,21 @@ State startInputMode(StateMachine *machine, Signal signal);
 State waitForInput(StateMachine *machine, Signal signal);
 State playCorrectChoice(StateMachine *machine, Signal signal);
 State playGameover(StateMachine *machine, Signal signal);
+State idleMode(StateMachine *machine, Signal signal);
 
 typedef State (*SignalHandler)(StateMachine *, Signal);
 
+static volatile sig_atomic_t quit_requested = 0;
+static volatile sig_atomic_t stats_requested = 0;
+
+static void onProcessSignal(int signo) {
+    if (signo == SIGUSR1) {
+        stats_requested = 1;
+    } else {
+        quit_requested = 1;
+    }
+}
+
 static const SignalHandler signal_handlers[STATE_COUNT] = {
     resetGame,
     startPlaybackMode,
@@ -74,83 +200,887 @@ static const SignalHandler signal_handlers[STATE_COUNT] = {
     waitForInput,
     playCorrectChoice,
     playGameover,
+    idleMode,
 };
 
-bool StateMachine_init(StateMachine *machine_out) {
-    srand(time(NULL));
+static inline State StateMachine_step(StateMachine *machine, Signal signal);
 
-    machine_out->leds_dev = initLedsDevice();
-    if (machine_out->leds_dev == NULL) goto error;
-    machine_out->input_dev = initInputDevice();
-    if (machine_out->input_dev == NULL) goto error_deinit_leds;
-    machine_out->sound_dev = initSoundDevice();
-    if (machine_out->sound_dev == NULL) goto error_deinit_input_deinit_leds;
+// game state only, with no devices attached; the output is kept but never
+// committed anywhere
+void StateMachine_initDetached(StateMachine *machine_out, int id, int choice_count, uint64_t seed,
+    bool log_games, TimerQueue *timer_queue) {
+    int i;
 
+    machine_out->leds_dev = NULL;
+    machine_out->input_dev = NULL;
+    machine_out->sound_dev = NULL;
+    machine_out->capture = NULL;
+    machine_out->id = id;
+    machine_out->choice_count = choice_count;
     machine_out->state = state_reset_game;
-    machine_out->running = true;
+    machine_out->timer_queue = timer_queue;
+    machine_out->recorder = NULL;
+    machine_out->telemetry = NULL;
+    machine_out->scores = NULL;
+    for (i = 0; i < TIMER_TAG_COUNT; i++) {
+        Timer_init(&machine_out->timers[i], i, machine_out);
+    }
+    machine_out->output.leds = 0;
+    machine_out->output.tone = NO_TONE;
+    machine_out->committed_output = machine_out->output;
+    // no such state, so the first commit always shows the status
+    machine_out->committed_status.state = STATE_COUNT;
+    machine_out->loop_rate = 0;
+    machine_out->uncommitted_press_at = NO_DEADLINE;
+    machine_out->next_game_seed = seed;
+    machine_out->game_started_at = 0;
+    machine_out->log_games = log_games;
+    machine_out->idle_after = 0;
+    machine_out->attract_period = 0;
+    machine_out->attract_pos = 0;
+    Histogram_init(&machine_out->press_latency);
+    Histogram_init(&machine_out->step_jitter);
+    machine_out->transitions = 0;
+    machine_out->games_played = 0;
+    machine_out->high_score = 0;
+    machine_out->input_events = 0;
+    machine_out->timeouts = 0;
+    // wall clock, since nanoTimestamp may be virtual
+    clock_gettime(CLOCK_MONOTONIC, &machine_out->started_at);
+}
+
+bool StateMachine_init(StateMachine *machine_out, const StationConfig *config, uint64_t seed,
+    bool log_games, TimerQueue *timer_queue) {
+    LedsDevice *leds_dev;
+    InputDevice *input_dev;
+    SoundDevice *sound_dev;
+
+    leds_dev = initLedsDevice(config);
+    if (leds_dev == NULL) goto error;
+    input_dev = initInputDevice(config);
+    if (input_dev == NULL) goto error_deinit_leds;
+    sound_dev = initSoundDevice(config);
+    if (sound_dev == NULL) goto error_deinit_input_deinit_leds;
+
+    StateMachine_initDetached(machine_out, config->id, config->choice_count, seed, log_games, timer_queue);
+    machine_out->leds_dev = leds_dev;
+    machine_out->input_dev = input_dev;
+    machine_out->sound_dev = sound_dev;
+    setLeds(leds_dev, 0);
 
     return true;
 
 error_deinit_sound_deinit_input_deinit_leds:
-    deinitSoundDevice(machine_out->sound_dev);
+    deinitSoundDevice(sound_dev);
     
 error_deinit_input_deinit_leds:
-    deinitInputDevice(machine_out->input_dev);
+    deinitInputDevice(input_dev);
     
 error_deinit_leds:
-    deinitLedsDevice(machine_out->leds_dev);
+    deinitLedsDevice(leds_dev);
 
 error:
     return false;
 }
 
-bool StateMachine_pollSignal(StateMachine *machine, Signal *signal_out) {
-    time_t cur_time, elapsed;
-    
-    // check timer
-    if (machine->timer.active) {
-        cur_time = nanoTimestamp();
-        elapsed = cur_time - machine->timer.started_at;
-        if (elapsed >= machine->timer.duration) {
-            machine->timer.active = false;
-            *signal_out = signal_timeout;
-            return true;
+void StateMachine_deinit(StateMachine *machine) {
+    if (machine->capture != NULL) InputCapture_stop(machine->capture);
+    deinitSoundDevice(machine->sound_dev);
+    deinitInputDevice(machine->input_dev);
+    deinitLedsDevice(machine->leds_dev);
+}
+
+void StateMachine_printStats(StateMachine *machine) {
+    struct timespec now;
+    double elapsed;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - machine->started_at.tv_sec) +
+        (now.tv_nsec - machine->started_at.tv_nsec) / 1e9;
+
+    fprintf(stderr, "%llu games, %llu transitions in %.3fs (%.0f games/s, %.0f transitions/s)\n",
+        machine->games_played,
+        machine->transitions,
+        elapsed,
+        machine->games_played / elapsed,
+        machine->transitions / elapsed);
+    Histogram_print(&machine->press_latency, stderr, "press latency");
+    Histogram_print(&machine->step_jitter, stderr, "step jitter");
+    fprintf(stderr, "current game seed: %llu\n", (unsigned long long) machine->game_seed);
+}
+
+void StateMachine_showChoice(StateMachine *machine, Choice choice) {
+    machine->output.leds = Choice_bit(choice);
+    machine->output.tone = choice;
+}
+
+void StateMachine_clearOutput(StateMachine *machine) {
+    machine->output.leds = 0;
+    machine->output.tone = NO_TONE;
+}
+
+// at most one LED update and one tone update, skipped when nothing changed
+void StateMachine_commitOutput(StateMachine *machine) {
+    Output *want = &machine->output;
+    Output *have = &machine->committed_output;
+    StationStatus *status = &machine->committed_status;
+
+    if (machine->leds_dev == NULL) return;
+
+    if (want->leds != have->leds) {
+        setLeds(machine->leds_dev, want->leds);
+        have->leds = want->leds;
+    }
+    if (want->tone != have->tone) {
+        if (want->tone == NO_TONE) {
+            stopTone(machine->sound_dev);
+        } else {
+            startTone(machine->sound_dev, want->tone);
         }
+        have->tone = want->tone;
     }
 
-    if (pollInput(machine->input_dev, &machine->input_event)) {
-        *signal_out = signal_input;
-        return true;
+    if (machine->state != status->state || machine->sequence_len != status->round ||
+        machine->loop_rate != status->loop_rate) {
+        status->state = machine->state;
+        status->round = machine->sequence_len;
+        status->loop_rate = machine->loop_rate;
+        setStatus(machine->leds_dev, status);
     }
 
-    return false;
+    if (machine->uncommitted_press_at != NO_DEADLINE) {
+        Histogram_record(&machine->press_latency, nanoTimestamp() - machine->uncommitted_press_at);
+        machine->uncommitted_press_at = NO_DEADLINE;
+    }
 }
 
-void StateMachine_run(StateMachine *machine) {
-    Signal signal;
+void StateMachine_recordSignal(StateMachine *machine, Signal signal) {
+    Record record = { 0 };
+
+    record.at = machine->now;
+    record.station = (uint8_t) machine->id;
+    switch (signal) {
+    case signal_enter:
+        record.kind = record_start;
+        break;
+    case signal_input:
+        record.kind = record_input;
+        record.arg0 = (uint8_t) machine->input_event.type;
+        record.arg1 = (uint8_t) machine->input_event.choice;
+        record.detail = (uint32_t) ((machine->now - machine->input_event.timestamp) / 1000);
+        break;
+    case signal_timeout:
+        record.kind = record_timeout;
+        record.arg0 = (uint8_t) machine->timeout_tag;
+        break;
+    default:
+        return;
+    }
+
+    Recorder_append(machine->recorder, &record);
+}
+
+void StateMachine_recordTransition(StateMachine *machine, State next_state) {
+    Record record = { 0 };
+
+    record.at = machine->now;
+    record.kind = record_transition;
+    record.station = (uint8_t) machine->id;
+    record.arg0 = (uint8_t) machine->state;
+    record.arg1 = (uint8_t) next_state;
+
+    Recorder_append(machine->recorder, &record);
+}
+
+void StateMachine_publish(StateMachine *machine) {
+    TelemetryCounters counters;
+
+    counters.state = machine->state;
+    counters.sequence_len = machine->sequence_len;
+    counters.games_played = machine->games_played;
+    counters.high_score = machine->high_score;
+    counters.input_events = machine->input_events;
+    counters.timeouts = machine->timeouts;
+
+    Telemetry_publishStation(machine->telemetry, machine->id, &counters);
+}
+
+void StateMachine_keepScore(StateMachine *machine) {
+    struct timespec ended_at;
+
+    clock_gettime(CLOCK_REALTIME, &ended_at);
+    ScoreStore_append(machine->scores, machine->id, (uint32_t) machine->sequence_len, machine->game_seed,
+        (int64_t) ended_at.tv_sec * NS_PER_SEC + ended_at.tv_nsec, machine->now - machine->game_started_at);
+}
+
+// through the TRANSITIONS table, or the per-state handlers
+static inline State StateMachine_handle(StateMachine *machine, Signal signal, bool use_table) {
+    if (use_table) return StateMachine_step(machine, signal);
+
+    return signal_handlers[machine->state](machine, signal);
+}
+
+// runs the action for signal and every transition that follows from it,
+// then pushes the resulting output to the devices
+static inline void StateMachine_dispatchVia(StateMachine *machine, Signal signal, bool use_table) {
     State next_state;
 
-    next_state = signal_handlers[machine->state](machine, signal_enter);
+    if (machine->recorder != NULL) StateMachine_recordSignal(machine, signal);
+    if (signal == signal_input) machine->input_events++;
+    if (signal == signal_timeout) machine->timeouts++;
+
+    TRACE_SIGNAL(machine->id, machine->state, signal, machine->now);
+    next_state = StateMachine_handle(machine, signal, use_table);
+    while (next_state != machine->state) {
+        TRACE_SIGNAL(machine->id, machine->state, signal_exit, machine->now);
+        StateMachine_handle(machine, signal_exit, use_table);
+        if (machine->recorder != NULL) StateMachine_recordTransition(machine, next_state);
+        TRACE_TRANSITION(machine->id, machine->state, next_state, machine->now);
+        machine->state = next_state;
+        machine->transitions++;
+        TRACE_SIGNAL(machine->id, machine->state, signal_enter, machine->now);
+        next_state = StateMachine_handle(machine, signal_enter, use_table);
+    }
+
+    StateMachine_commitOutput(machine);
+    if (machine->telemetry != NULL) StateMachine_publish(machine);
+}
+
+void StateMachine_dispatch(StateMachine *machine, Signal signal) {
+    StateMachine_dispatchVia(machine, signal, true);
+}
+
+// the function pointer per state and switch per handler the table replaced,
+// kept for --bench-dispatch to compare against
+void StateMachine_dispatchHandlers(StateMachine *machine, Signal signal) {
+    StateMachine_dispatchVia(machine, signal, false);
+}
+
+void StateMachine_handleInput(StateMachine *machine) {
+    if (machine->capture != NULL) {
+        while (InputCapture_poll(machine->capture, &machine->input_event)) {
+            StateMachine_dispatch(machine, signal_input);
+        }
+        return;
+    }
+
+    while (pollInput(machine->input_dev, &machine->input_event)) {
+        StateMachine_dispatch(machine, signal_input);
+    }
+}
+
+// with threaded input the event loop can't tell when input has run out
+bool Engine_inputExhausted(Engine *engine) {
+    int i;
+
+    for (i = 0; i < engine->machine_count; i++) {
+        if (engine->machines[i].capture == NULL) return false;
+        if (!InputCapture_exhausted(engine->machines[i].capture)) return false;
+    }
+
+    return true;
+}
+
+static uint64_t stationSeed(uint64_t seed, int id) {
+    // station 0 keeps the seed as given, so single-station games reproduce
+    if (id == 0) return seed;
+
+    return Rng_mix(seed ^ (0xd1b54a32d192ed03ULL * (uint64_t) id));
+}
+
+static void printHighScores(const ScoreStore *scores) {
+    const ScoreRecord *top;
+    char when[32];
+    struct tm tm;
+    time_t ended_at;
+    int count, i;
+
+    count = ScoreStore_top(scores, &top);
+    if (count == 0) return;
+
+    fprintf(stderr, "high scores:\n");
+    for (i = 0; i < count; i++) {
+        ended_at = (time_t) (top[i].ended_at / NS_PER_SEC);
+        if (localtime_r(&ended_at, &tm) == NULL || strftime(when, sizeof(when), "%Y-%m-%d %H:%M", &tm) == 0) {
+            strcpy(when, "?");
+        }
+        fprintf(stderr, "  %2d. round %-4u station %-2u %s  %.1fs  seed %llu\n",
+            i + 1, top[i].round, top[i].station, when,
+            (double) top[i].duration / NS_PER_SEC,
+            (unsigned long long) top[i].seed);
+    }
+}
+
+bool Engine_init(Engine *engine_out, const Options *options) {
+    RecordingHeader header = { 0 };
+    StateMachine *machine;
+    int i;
+
+    engine_out->machines = (StateMachine *) malloc(options->station_count * sizeof(StateMachine));
+    if (engine_out->machines == NULL) goto error;
+    engine_out->machine_count = 0;
+
+    engine_out->loop = initEventLoop();
+    if (engine_out->loop == NULL) goto error_free_machines;
+
+    TimerQueue_init(&engine_out->timer_queue, engine_out->timer_heap, MAX_STATIONS * TIMER_TAG_COUNT);
+
+    engine_out->recorder = NULL;
+    if (options->record_path != NULL) {
+        header.station_count = options->station_count;
+        header.seed = options->seed;
+        for (i = 0; i < options->station_count; i++) {
+            header.choice_counts[i] = (uint8_t) options->stations[i].choice_count;
+        }
+        header.idle_after = options->idle_after;
+        header.attract_period = options->attract_period;
+        engine_out->recorder = Recorder_open(options->record_path, RECORDER_DEFAULT_CAPACITY, &header);
+        if (engine_out->recorder == NULL) goto error_deinit_loop;
+    }
+
+    engine_out->telemetry = NULL;
+    if (options->telemetry_name != NULL) {
+        engine_out->telemetry = Telemetry_open(options->telemetry_name, options->station_count);
+        if (engine_out->telemetry == NULL) goto error_close_recorder;
+    }
+
+    engine_out->scores = NULL;
+    if (options->scores_path != NULL) {
+        engine_out->scores = ScoreStore_open(options->scores_path);
+        if (engine_out->scores == NULL) goto error_close_telemetry;
+        printHighScores(engine_out->scores);
+    }
+
+    for (i = 0; i < options->station_count; i++) {
+        machine = &engine_out->machines[i];
+        if (!StateMachine_init(machine, &options->stations[i], stationSeed(options->seed, i),
+                options->log_games, &engine_out->timer_queue)) {
+            fprintf(stderr, "Failed to initialize station %d\n", i);
+            goto error_deinit_machines;
+        }
+        engine_out->machine_count++;
+        machine->recorder = engine_out->recorder;
+        machine->telemetry = engine_out->telemetry;
+        machine->scores = engine_out->scores;
+        machine->idle_after = options->idle_after;
+        machine->attract_period = options->attract_period;
+        if (options->threaded_input) {
+            machine->capture = InputCapture_start(machine->input_dev);
+            if (machine->capture == NULL) goto error_deinit_machines;
+            if (!watchWakeupFd(engine_out->loop, InputCapture_fd(machine->capture), machine)) {
+                goto error_deinit_machines;
+            }
+        } else if (!watchInput(engine_out->loop, machine->input_dev, machine)) {
+            goto error_deinit_machines;
+        }
+    }
+    engine_out->running = true;
+    engine_out->idle_since = NO_DEADLINE;
+    engine_out->idle_time = 0;
+    engine_out->idle_cpu_time = 0;
+    engine_out->idle_wakeups = 0;
+
+    return true;
+
+error_deinit_machines:
+    for (i = 0; i < engine_out->machine_count; i++) {
+        StateMachine_deinit(&engine_out->machines[i]);
+    }
+    if (engine_out->scores != NULL) ScoreStore_close(engine_out->scores);
+
+error_close_telemetry:
+    if (engine_out->telemetry != NULL) Telemetry_close(engine_out->telemetry);
+
+error_close_recorder:
+    if (engine_out->recorder != NULL) Recorder_close(engine_out->recorder);
+
+error_deinit_loop:
+    deinitEventLoop(engine_out->loop);
+
+error_free_machines:
+    free(engine_out->machines);
+
+error:
+    return false;
+}
+
+void Engine_raiseCapturePriority(Engine *engine, int priority) {
+    int i;
+
+    for (i = 0; i < engine->machine_count; i++) {
+        InputCapture_setPriority(engine->machines[i].capture, priority);
+    }
+}
+
+void Engine_deinit(Engine *engine) {
+    int i;
+
+    for (i = 0; i < engine->machine_count; i++) {
+        StateMachine_deinit(&engine->machines[i]);
+    }
+    if (engine->scores != NULL) ScoreStore_close(engine->scores);
+    if (engine->telemetry != NULL) Telemetry_close(engine->telemetry);
+    if (engine->recorder != NULL) Recorder_close(engine->recorder);
+    deinitEventLoop(engine->loop);
+    free(engine->machines);
+}
+
+static Nanoseconds cpuTime(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return (Nanoseconds) ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+static bool Engine_allIdle(Engine *engine) {
+    int i;
+
+    for (i = 0; i < engine->machine_count; i++) {
+        if (engine->machines[i].state != state_idle) return false;
+    }
+
+    return true;
+}
+
+// called once a pass, just before the loop goes to sleep
+void Engine_trackIdle(Engine *engine, Nanoseconds now) {
+    bool idle = Engine_allIdle(engine);
+
+    if (idle && engine->idle_since == NO_DEADLINE) {
+        engine->idle_since = now;
+        engine->idle_cpu_since = cpuTime();
+    } else if (!idle && engine->idle_since != NO_DEADLINE) {
+        engine->idle_time += now - engine->idle_since;
+        engine->idle_cpu_time += cpuTime() - engine->idle_cpu_since;
+        engine->idle_since = NO_DEADLINE;
+    }
+}
+
+void Engine_printStats(Engine *engine) {
+    Nanoseconds idle_time = engine->idle_time;
+    Nanoseconds idle_cpu_time = engine->idle_cpu_time;
+    int i;
+
+    for (i = 0; i < engine->machine_count; i++) {
+        if (engine->machine_count > 1) fprintf(stderr, "station %d:\n", i);
+        StateMachine_printStats(&engine->machines[i]);
+    }
+    if (engine->idle_since != NO_DEADLINE) {
+        idle_time += nanoTimestamp() - engine->idle_since;
+        idle_cpu_time += cpuTime() - engine->idle_cpu_since;
+    }
+    // rates over a few scattered instants of idling mean nothing
+    if (idle_time >= IDLE_STATS_MIN_TIME) {
+        fprintf(stderr, "idle %.3fs: %.3f wakeups/s, %.3fms cpu (%.4f%%)\n",
+            (double) idle_time / NS_PER_SEC,
+            (double) engine->idle_wakeups * NS_PER_SEC / idle_time,
+            (double) idle_cpu_time / 1e6,
+            100.0 * idle_cpu_time / idle_time);
+    } else if (idle_time > 0) {
+        fprintf(stderr, "idle %.3fs: %llu wakeups, %.3fms cpu\n",
+            (double) idle_time / NS_PER_SEC,
+            (unsigned long long) engine->idle_wakeups,
+            (double) idle_cpu_time / 1e6);
+    }
+    TRACE_PRINT_STATS(stderr);
+}
+
+void Engine_run(Engine *engine) {
+    StateMachine *machine;
+    Timer *expired;
+    Timer *next_timer;
+    void *ready[MAX_STATIONS];
+    int ready_count;
+    Nanoseconds now, deadline, display_due;
+    uint64_t iterations = 0;
+    uint64_t loop_rate;
+    uint64_t window_iterations = 0;
+    Nanoseconds window_started_at;
+    struct sigaction action = { 0 };
+    sigset_t handled_signals, wait_mask;
+    int i;
+
+    // the signals below are only delivered while asleep in waitForEvents,
+    // so they never interrupt a handler halfway through
+    action.sa_handler = onProcessSignal;
+    sigemptyset(&action.sa_mask);
+    sigemptyset(&handled_signals);
+    sigaddset(&handled_signals, SIGINT);
+    sigaddset(&handled_signals, SIGTERM);
+    sigaddset(&handled_signals, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &handled_signals, &wait_mask);
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    sigaction(SIGUSR1, &action, NULL);
+
+    now = nanoTimestamp();
+    for (i = 0; i < engine->machine_count; i++) {
+        machine = &engine->machines[i];
+        machine->now = now;
+        StateMachine_dispatch(machine, signal_enter);
+    }
+    window_started_at = now;
     
-    while (machine->running) {
-        // handle state transition
-        if (next_state != machine->state) {
-            signal_handlers[machine->state](machine, signal_exit);
-            machine->state = next_state;
-            next_state = signal_handlers[machine->state](machine, signal_enter);
-            continue;
+    while (engine->running) {
+        iterations++;
+        if (now - window_started_at >= NS_PER_SEC) {
+            loop_rate = (iterations - window_iterations) * NS_PER_SEC / (now - window_started_at);
+            if (engine->telemetry != NULL) Telemetry_publishLoop(engine->telemetry, iterations, loop_rate);
+            for (i = 0; i < engine->machine_count; i++) {
+                engine->machines[i].loop_rate = loop_rate;
+                StateMachine_commitOutput(&engine->machines[i]);
+            }
+            window_iterations = iterations;
+            window_started_at = now;
+        }
+
+        // expired timers of every station, in deadline order
+        while ((expired = TimerQueue_popExpired(&engine->timer_queue, now)) != NULL) {
+            machine = (StateMachine *) expired->owner;
+            machine->now = now;
+            machine->timeout_tag = expired->tag;
+            StateMachine_dispatch(machine, signal_timeout);
+        }
+
+        // idle now, so writing the log out can't delay a handler
+        if (engine->recorder != NULL) Recorder_flushIdle(engine->recorder, now);
+
+        // nothing pending, sleep until the next edge/keypress or timer expiry
+        Engine_trackIdle(engine, now);
+        next_timer = TimerQueue_peek(&engine->timer_queue);
+        if (next_timer == NULL && Engine_inputExhausted(engine)) break;
+        deadline = next_timer != NULL ? next_timer->deadline : NO_DEADLINE;
+        // frames a display held back still have to go out while idle
+        for (i = 0; i < engine->machine_count; i++) {
+            display_due = flushLeds(engine->machines[i].leds_dev, now);
+            if (display_due != NO_DEADLINE && (deadline == NO_DEADLINE || display_due < deadline)) {
+                deadline = display_due;
+            }
+        }
+        ready_count = waitForEvents(engine->loop, deadline, &wait_mask, ready, MAX_STATIONS);
+        if (ready_count < 0) {
+            engine->running = false;
+        }
+        now = nanoTimestamp();
+        if (engine->idle_since != NO_DEADLINE) engine->idle_wakeups++;
+
+        for (i = 0; i < ready_count; i++) {
+            machine = (StateMachine *) ready[i];
+            machine->now = now;
+            StateMachine_handleInput(machine);
         }
-        
-        if (StateMachine_pollSignal(machine, &signal)) {
-            next_state = signal_handlers[machine->state](machine, signal);
+
+        if (stats_requested) {
+            stats_requested = 0;
+            Engine_printStats(engine);
+        }
+        if (quit_requested) {
+            engine->running = false;
         }
     }
+
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
 }
 
-void StateMachine_startTimer(StateMachine *machine, time_t duration) {
-    machine->timer.duration = duration;
-    machine->timer.started_at = nanoTimestamp();
-    machine->timer.active = true;
+static void sleepUntil(const struct timespec *start, Nanoseconds offset) {
+    struct timespec wake_at;
+
+    wake_at.tv_sec = start->tv_sec + offset / NS_PER_SEC;
+    wake_at.tv_nsec = start->tv_nsec + offset % NS_PER_SEC;
+    if (wake_at.tv_nsec >= NS_PER_SEC) {
+        wake_at.tv_sec++;
+        wake_at.tv_nsec -= NS_PER_SEC;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake_at, NULL) == EINTR);
+}
+
+// Feeds the signals of a recording back through the handlers and checks that
+// every station makes exactly the recorded transitions. Returns false on the
+// first difference.
+bool Engine_replay(Engine *engine, const Recording *recording, bool real_time) {
+    const Record *record;
+    const Record *produced;
+    StateMachine *machine;
+    Recorder *capture;
+    Timer *expired;
+    Signal signal;
+    struct timespec started;
+    size_t i, j;
+    bool identical = false;
+    
+    capture = Recorder_open(NULL, RECORDER_DEFAULT_CAPACITY, NULL);
+    if (capture == NULL) return false;
+    for (i = 0; i < (size_t) engine->machine_count; i++) {
+        engine->machines[i].recorder = capture;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    i = 0;
+    while (i < recording->count) {
+        record = &recording->records[i];
+        if (record->station >= engine->machine_count || record->kind == record_transition) {
+            fprintf(stderr, "replay: unexpected record %zu\n", i);
+            goto exit;
+        }
+        machine = &engine->machines[record->station];
+        if (real_time) sleepUntil(&started, record->at - recording->records[0].at);
+
+        machine->now = record->at;
+        switch (record->kind) {
+        case record_start:
+            signal = signal_enter;
+            break;
+        case record_input:
+            machine->input_event.type = (EventType) record->arg0;
+            machine->input_event.choice = (Choice) record->arg1;
+            machine->input_event.timestamp = record->at - (Nanoseconds) record->detail * 1000;
+            signal = signal_input;
+            break;
+        case record_timeout:
+            expired = TimerQueue_popExpired(&engine->timer_queue, record->at);
+            if (expired == NULL || expired->owner != machine || expired->tag != record->arg0) {
+                fprintf(stderr, "replay: station %d timer %d did not expire at record %zu\n",
+                    machine->id, record->arg0, i);
+                goto exit;
+            }
+            machine->timeout_tag = expired->tag;
+            signal = signal_timeout;
+            break;
+        default:
+            fprintf(stderr, "replay: unknown record kind %d at %zu\n", record->kind, i);
+            goto exit;
+        }
+        StateMachine_dispatch(machine, signal);
+
+        if (capture->len > recording->count - i) {
+            fprintf(stderr, "replay: station %d made %zu records from record %zu, the recording "
+                "has only %zu left\n", machine->id, capture->len, i, recording->count - i);
+            goto exit;
+        }
+        for (j = 0; j < capture->len; j++, i++) {
+            record = &recording->records[i];
+            produced = &capture->records[j];
+            if (memcmp(record, produced, sizeof(Record)) != 0) {
+                fprintf(stderr, "replay: station %d diverged at record %zu: recorded "
+                    "{station %d kind %d %d/%d at %lld}, replayed {station %d kind %d %d/%d at %lld}\n",
+                    machine->id, i,
+                    record->station, record->kind, record->arg0, record->arg1, (long long) record->at,
+                    produced->station, produced->kind, produced->arg0, produced->arg1, (long long) produced->at);
+                goto exit;
+            }
+        }
+        capture->len = 0;
+    }
+    identical = true;
+    fprintf(stderr, "replayed %zu records, transitions identical\n", recording->count);
+
+exit:
+    for (i = 0; i < (size_t) engine->machine_count; i++) {
+        engine->machines[i].recorder = NULL;
+    }
+    Recorder_close(capture);
+
+    return identical;
+}
+
+Choice StateMachine_sequenceAt(StateMachine *machine, uint64_t index) {
+    return (Choice) Rng_uniformAt(machine->game_seed, index, machine->choice_count);
+}
+
+void StateMachine_startTimer(StateMachine *machine, TimerTag tag, Nanoseconds duration) {
+    TimerQueue_schedule(machine->timer_queue, &machine->timers[tag], machine->now + duration);
+    if (tag == timer_step) {
+        machine->step_started_at = machine->now;
+        machine->step_duration = duration;
+    }
+}
+
+// called when timer_step ends a playback step
+void StateMachine_recordStepJitter(StateMachine *machine) {
+    Nanoseconds deviation = machine->now - machine->step_started_at - machine->step_duration;
+
+    Histogram_record(&machine->step_jitter, deviation < 0 ? -deviation : deviation);
+}
+
+void StateMachine_cancelTimer(StateMachine *machine, TimerTag tag) {
+    TimerQueue_cancel(machine->timer_queue, &machine->timers[tag]);
+}
+
+// What each state does with each signal, as actions returning the next
+// state. The handlers below and the TRANSITIONS table both run these.
+
+static inline State resetGameEnter(StateMachine *machine) {
+    machine->sequence_len = 0;
+    machine->game_seed = machine->next_game_seed;
+    machine->next_game_seed = Rng_nextSeed(machine->game_seed);
+    machine->game_started_at = machine->now;
+    StateMachine_cancelTimer(machine, timer_step);
+
+    return state_start_playback_mode;
+}
+
+static inline State startPlaybackModeEnter(StateMachine *machine) {
+    machine->sequence_len++;
+    machine->cur_sequence_index = 0;
+    StateMachine_startTimer(machine, timer_step, PRE_PLAYBACK_DELAY);
+
+    return state_start_playback_mode;
+}
+
+static inline State startPlaybackModeTimeout(StateMachine *machine) {
+    if (machine->timeout_tag != timer_step) return state_start_playback_mode;
+
+    return state_play_elem;
+}
+
+static inline State playElemEnter(StateMachine *machine) {
+    Choice elem;
+
+    if (machine->cur_sequence_index >= machine->sequence_len) return state_start_input_mode;
+    elem = StateMachine_sequenceAt(machine, machine->cur_sequence_index);
+    StateMachine_showChoice(machine, elem);
+    StateMachine_startTimer(machine, timer_step, PLAYBACK_ON_DURATION);
+    machine->cur_sequence_index++;
+
+    return state_play_elem;
+}
+
+static inline State playElemTimeout(StateMachine *machine) {
+    if (machine->timeout_tag != timer_step) return state_play_elem;
+    StateMachine_recordStepJitter(machine);
+
+    return state_pause_elem;
+}
+
+static inline State playElemExit(StateMachine *machine) {
+    StateMachine_clearOutput(machine);
+
+    return state_play_elem;
+}
+
+static inline State pauseElemEnter(StateMachine *machine) {
+    StateMachine_startTimer(machine, timer_step, PLAYBACK_OFF_DURATION);
+
+    return state_pause_elem;
+}
+
+static inline State pauseElemTimeout(StateMachine *machine) {
+    if (machine->timeout_tag != timer_step) return state_pause_elem;
+    StateMachine_recordStepJitter(machine);
+
+    return state_play_elem;
+}
+
+static inline State startInputModeEnter(StateMachine *machine) {
+    machine->cur_sequence_index = 0;
+    // presses made during playback don't count as answers
+    if (machine->capture != NULL) {
+        InputCapture_clear(machine->capture, machine->now);
+    } else if (machine->input_dev != NULL) {
+        clearInputEvents(machine->input_dev);
+    }
+
+    return state_wait_for_input;
+}
+
+static inline State waitForInputEnter(StateMachine *machine) {
+    if (machine->idle_after > 0) StateMachine_startTimer(machine, timer_idle, machine->idle_after);
+
+    return state_wait_for_input;
+}
+
+static inline State waitForInputInput(StateMachine *machine) {
+    if (machine->input_event.type != event_button_down) return state_wait_for_input;
+
+    return machine->input_event.choice == StateMachine_sequenceAt(machine, machine->cur_sequence_index) ?
+        state_play_correct_choice :
+        state_play_gameover;
+}
+
+static inline State waitForInputTimeout(StateMachine *machine) {
+    if (machine->timeout_tag != timer_idle) return state_wait_for_input;
+
+    return state_idle;
+}
+
+static inline State waitForInputExit(StateMachine *machine) {
+    StateMachine_cancelTimer(machine, timer_idle);
+
+    return state_wait_for_input;
+}
+
+static inline State playCorrectChoiceEnter(StateMachine *machine) {
+    StateMachine_showChoice(machine, StateMachine_sequenceAt(machine, machine->cur_sequence_index));
+    machine->uncommitted_press_at = machine->input_event.timestamp;
+
+    return state_play_correct_choice;
+}
+
+static inline State playCorrectChoiceInput(StateMachine *machine) {
+    if (machine->input_event.type != event_button_up) return state_play_correct_choice;
+    if (machine->input_event.choice != StateMachine_sequenceAt(machine, machine->cur_sequence_index)) {
+        return state_play_correct_choice;
+    }
+    machine->cur_sequence_index++;
+    if (machine->cur_sequence_index >= machine->sequence_len) return state_start_playback_mode;
+
+    return state_wait_for_input;
+}
+
+static inline State playCorrectChoiceExit(StateMachine *machine) {
+    StateMachine_clearOutput(machine);
+
+    return state_play_correct_choice;
+}
+
+static inline State playGameoverEnter(StateMachine *machine) {
+    machine->games_played++;
+    if (machine->sequence_len > machine->high_score) machine->high_score = machine->sequence_len;
+    if (machine->log_games) {
+        fprintf(stderr, "station %d game over at round %llu, seed %llu\n",
+            machine->id,
+            (unsigned long long) machine->sequence_len,
+            (unsigned long long) machine->game_seed);
+    }
+    if (machine->scores != NULL) StateMachine_keepScore(machine);
+
+    return state_reset_game;
+}
+
+// Only a button press leaves idle, into a new game. Without an attract
+// animation no timer is armed, so the loop sleeps on the input fds until
+// one comes.
+static inline State idleModeEnter(StateMachine *machine) {
+    machine->attract_pos = 0;
+    if (machine->attract_period > 0) {
+        machine->output.leds = Choice_bit(machine->attract_pos);
+        StateMachine_startTimer(machine, timer_attract, machine->attract_period);
+    }
+
+    return state_idle;
+}
+
+static inline State idleModeTimeout(StateMachine *machine) {
+    if (machine->timeout_tag != timer_attract) return state_idle;
+    machine->attract_pos = (machine->attract_pos + 1) % machine->choice_count;
+    machine->output.leds = Choice_bit(machine->attract_pos);
+    StateMachine_startTimer(machine, timer_attract, machine->attract_period);
+
+    return state_idle;
+}
+
+static inline State idleModeInput(StateMachine *machine) {
+    if (machine->input_event.type != event_button_down) return state_idle;
+
+    return state_reset_game;
+}
+
+static inline State idleModeExit(StateMachine *machine) {
+    StateMachine_cancelTimer(machine, timer_attract);
+    StateMachine_clearOutput(machine);
+
+    return state_idle;
 }
 
 State resetGame(StateMachine *machine, Signal signal) {
@@ -159,9 +1089,7 @@ State resetGame(StateMachine *machine, Signal signal) {
 
     switch (signal) {
     case signal_enter:
-        machine->sequence_len = 0;
-        machine->timer.active = false;
-        next_state = state_start_playback_mode;
+        next_state = resetGameEnter(machine);
         break;
     default:
         break;
@@ -173,16 +1101,13 @@ State resetGame(StateMachine *machine, Signal signal) {
 State startPlaybackMode(StateMachine *machine, Signal signal) {
     State next_state = state_start_playback_mode;
     assert(machine->state == next_state);
-    
+
     switch (signal) {
     case signal_enter:
-        machine->sequence[machine->sequence_len] = rand() % NUM_CHOICES;
-        machine->sequence_len++;
-        machine->cur_sequence_index = 0;
-        StateMachine_startTimer(machine, PRE_PLAYBACK_DELAY);
+        next_state = startPlaybackModeEnter(machine);
         break;
     case signal_timeout:
-        next_state = state_play_elem;
+        next_state = startPlaybackModeTimeout(machine);
         break;
     default:
         break;
@@ -192,28 +1117,18 @@ State startPlaybackMode(StateMachine *machine, Signal signal) {
 }
 
 State playElem(StateMachine *machine, Signal signal) {
-    Choice elem;
     State next_state = state_play_elem;
     assert(machine->state == next_state);
-    
+
     switch (signal) {
     case signal_enter:
-        if (machine->cur_sequence_index >= machine->sequence_len) {
-            next_state = state_start_input_mode;
-            break;
-        }
-        elem = machine->sequence[machine->cur_sequence_index];
-        turnOnLed(machine->leds_dev, elem);
-        startTone(machine->sound_dev, elem);
-        StateMachine_startTimer(machine, PLAYBACK_ON_DURATION);
-        machine->cur_sequence_index++;
+        next_state = playElemEnter(machine);
         break;
     case signal_timeout:
-        next_state = state_pause_elem;
+        next_state = playElemTimeout(machine);
         break;
     case signal_exit:
-        turnOffAllLeds(machine->leds_dev);
-        stopTone(machine->sound_dev);
+        next_state = playElemExit(machine);
         break;
     default:
         break;
@@ -225,13 +1140,13 @@ State playElem(StateMachine *machine, Signal signal) {
 State pauseElem(StateMachine *machine, Signal signal) {
     State next_state = state_pause_elem;
     assert(machine->state == next_state);
-    
+
     switch (signal) {
     case signal_enter:
-        StateMachine_startTimer(machine, PLAYBACK_OFF_DURATION);
+        next_state = pauseElemEnter(machine);
         break;
     case signal_timeout:
-        next_state = state_play_elem;
+        next_state = pauseElemTimeout(machine);
         break;
     default:
         break;
@@ -246,8 +1161,7 @@ State startInputMode(StateMachine *machine, Signal signal) {
 
     switch (signal) {
     case signal_enter:
-        machine->cur_sequence_index = 0;
-        next_state = state_wait_for_input;
+        next_state = startInputModeEnter(machine);
         break;
     default:
         break;
@@ -257,16 +1171,22 @@ State startInputMode(StateMachine *machine, Signal signal) {
 }
 
 State waitForInput(StateMachine *machine, Signal signal) {
-    Choice correct_choice = machine->sequence[machine->cur_sequence_index];
     State next_state = state_wait_for_input;
     assert(machine->state == next_state);
 
     switch (signal) {
+    case signal_enter:
+        next_state = waitForInputEnter(machine);
+        break;
     case signal_input:
-        if (machine->input_event.type != event_button_down) break;
-        next_state = machine->input_event.choice == correct_choice ?
-            state_play_correct_choice :
-            state_play_gameover;
+        next_state = waitForInputInput(machine);
+        break;
+    case signal_timeout:
+        next_state = waitForInputTimeout(machine);
+        break;
+    case signal_exit:
+        next_state = waitForInputExit(machine);
+        break;
     default:
         break;
     }
@@ -275,28 +1195,18 @@ State waitForInput(StateMachine *machine, Signal signal) {
 }
 
 State playCorrectChoice(StateMachine *machine, Signal signal) {
-    Choice cur_choice = machine->sequence[machine->cur_sequence_index];
     State next_state = state_play_correct_choice;
     assert(machine->state == next_state);
 
     switch (signal) {
     case signal_enter:
-        turnOnLed(machine->leds_dev, cur_choice);
-        startTone(machine->sound_dev, cur_choice);
+        next_state = playCorrectChoiceEnter(machine);
         break;
     case signal_input:
-        if (machine->input_event.type != event_button_up) break;
-        if (machine->input_event.choice != cur_choice) break;
-        machine->cur_sequence_index++;
-        if (machine->cur_sequence_index >= machine->sequence_len) {
-            next_state = state_start_playback_mode;
-        } else {
-            next_state = state_wait_for_input;
-        }
+        next_state = playCorrectChoiceInput(machine);
         break;
     case signal_exit:
-        turnOffAllLeds(machine->leds_dev);
-        stopTone(machine->sound_dev);
+        next_state = playCorrectChoiceExit(machine);
         break;
     default:
         break;
@@ -309,20 +1219,757 @@ State playGameover(StateMachine *machine, Signal signal) {
     State next_state = state_play_gameover;
     assert(machine->state == next_state);
 
-    next_state = state_reset_game;
+    switch (signal) {
+    case signal_enter:
+        next_state = playGameoverEnter(machine);
+        break;
+    default:
+        break;
+    }
+
+    return next_state;
+}
+
+State idleMode(StateMachine *machine, Signal signal) {
+    State next_state = state_idle;
+    assert(machine->state == next_state);
+
+    switch (signal) {
+    case signal_enter:
+        next_state = idleModeEnter(machine);
+        break;
+    case signal_timeout:
+        next_state = idleModeTimeout(machine);
+        break;
+    case signal_input:
+        next_state = idleModeInput(machine);
+        break;
+    case signal_exit:
+        next_state = idleModeExit(machine);
+        break;
+    default:
+        break;
+    }
 
     return next_state;
 }
 
-int main(void) {
-    StateMachine machine;
+// The same transitions as one table of state, signal and the action run for
+// it. Pairs not listed leave the state as it is.
+#define TRANSITIONS(X) \
+    X(state_reset_game, signal_enter, resetGameEnter) \
+    X(state_start_playback_mode, signal_enter, startPlaybackModeEnter) \
+    X(state_start_playback_mode, signal_timeout, startPlaybackModeTimeout) \
+    X(state_play_elem, signal_enter, playElemEnter) \
+    X(state_play_elem, signal_timeout, playElemTimeout) \
+    X(state_play_elem, signal_exit, playElemExit) \
+    X(state_pause_elem, signal_enter, pauseElemEnter) \
+    X(state_pause_elem, signal_timeout, pauseElemTimeout) \
+    X(state_start_input_mode, signal_enter, startInputModeEnter) \
+    X(state_wait_for_input, signal_enter, waitForInputEnter) \
+    X(state_wait_for_input, signal_input, waitForInputInput) \
+    X(state_wait_for_input, signal_timeout, waitForInputTimeout) \
+    X(state_wait_for_input, signal_exit, waitForInputExit) \
+    X(state_play_correct_choice, signal_enter, playCorrectChoiceEnter) \
+    X(state_play_correct_choice, signal_input, playCorrectChoiceInput) \
+    X(state_play_correct_choice, signal_exit, playCorrectChoiceExit) \
+    X(state_play_gameover, signal_enter, playGameoverEnter) \
+    X(state_idle, signal_enter, idleModeEnter) \
+    X(state_idle, signal_timeout, idleModeTimeout) \
+    X(state_idle, signal_input, idleModeInput) \
+    X(state_idle, signal_exit, idleModeExit)
+
+typedef State (*Action)(StateMachine *);
+
+static const Action transition_table[STATE_COUNT][SIGNAL_COUNT] = {
+#define TRANSITION_ENTRY(from, on, action) [from][on] = action,
+    TRANSITIONS(TRANSITION_ENTRY)
+#undef TRANSITION_ENTRY
+};
+
+// one load and a direct call to the action, with no per-state switch
+static inline State StateMachine_step(StateMachine *machine, Signal signal) {
+    Action action = transition_table[machine->state][signal];
+
+    return action != NULL ? action(machine) : machine->state;
+}
+
+static void printUsage(const char *program) {
+    fprintf(stderr,
+        "usage: %s [--seed N] [--log-games] [--station SPEC]... [--record FILE | --replay FILE [--replay-speed full|real]] [--batch N ...] [--bench-dispatch N] [--telemetry NAME] [--scores FILE] [--idle-after S [--attract-ms N]] [--threaded-input] [--realtime [--cpu N] [--rt-priority N]]\n"
+        "  --seed N           seed of the first game (default: $GAME_SEED, else random)\n"
+        "  --log-games        print the round reached and seed of every game\n"
+        "  --realtime         lock memory and run under SCHED_FIFO\n"
+        "  --cpu N            with --realtime, pin the game to cpu N\n"
+        "  --rt-priority N    with --realtime, SCHED_FIFO priority (default %d), one\n"
+        "                     below the maximum at most with --threaded-input\n"
+        "  --threaded-input   read and timestamp input on a thread of its own, so\n"
+        "                     slow output can't delay it\n"
+        "  --record FILE      append every signal and transition to a binary log\n"
+        "  --replay FILE      replay a log through the state machine and check it\n"
+        "                     makes the same transitions\n"
+        "  --replay-speed S   full (default) or real, to replay with the recorded timing\n"
+        "  --batch N          simulate N sessions of synthetic players and print a\n"
+        "                     summary by error rate instead of playing\n"
+        "  --batch-games N    games per simulated session (default %d)\n"
+        "  --error-rate LO[:HI]  chance of a wrong press, spread over the sessions\n"
+        "                     (default %g); above 0, as only a wrong press ends a game\n"
+        "  --reaction-ms A:B  reaction time range of the players (default %d:%d)\n"
+        "  --batch-check      also play every session on the state machine and\n"
+        "                     check the results match\n"
+        "  --bench-dispatch N  play N games of the first batch session, at the lowest\n"
+        "                     --error-rate, through the transition table and through\n"
+        "                     the per-state handlers, and compare transitions/s\n"
+        "  --idle-after S     go idle after S seconds without input, 0 for never\n"
+        "                     (default %d); a button press starts a new game\n"
+        "  --attract-ms N     while idle, light the LEDs in turn every N ms instead\n"
+        "                     of staying dark\n"
+        "  --telemetry NAME   publish live counters to the shared memory segment\n"
+        "                     /dev/shm/NAME, see telemetry_reader\n"
+        "  --scores FILE      keep the result of every game in FILE, up to %llu\n"
+        "                     of them, and show the best ones on startup\n"
+#ifdef GAME_TRACE
+        "  --trace FILE       on exit, write the trace ring as Chrome trace JSON\n"
+#endif
+        "  --station SPEC     add a station, up to %d; SPEC is a comma separated list of\n"
+        "                     chip=PATH, choices=N, leds=A:B:C..., buttons=A:B:C...,\n"
+        "                     tones=HZ:HZ:HZ..., pwm=N|none,\n"
+        "                     audio=alsa[:DEVICE]|-|FILE.wav|none, any left out keep\n"
+        "                     the backend's defaults; the lists have one entry per\n"
+        "                     choice, 2 to %d of them (default %d)\n",
+        program, REALTIME_DEFAULT_PRIORITY,
+        DEFAULT_BATCH_GAMES, DEFAULT_ERROR_RATE, DEFAULT_REACTION_MIN_MS, DEFAULT_REACTION_MAX_MS,
+        DEFAULT_IDLE_AFTER_S, (unsigned long long) SCORE_MAX_RECORDS, MAX_STATIONS, MAX_CHOICES,
+        DEFAULT_CHOICE_COUNT);
+}
+
+static bool parseInt(const char *text, int *value_out) {
+    char *end;
+    long value;
+
+    errno = 0;
+    value = strtol(text, &end, 10);
+    *value_out = (int) value;
+
+    return errno == 0 && end != text && *end == '\0' && value >= 0 && value <= 0xffff;
+}
+
+static bool parseCount(const char *text, uint64_t *count_out) {
+    char *end;
+
+    errno = 0;
+    *count_out = strtoull(text, &end, 10);
+
+    return errno == 0 && end != text && *end == '\0' && *count_out > 0 && text[0] != '-';
+}
+
+// "LO" or "LO:HI", probabilities
+static bool parseRate(const char *text, double *min_out, double *max_out) {
+    char *end;
+
+    *min_out = strtod(text, &end);
+    *max_out = *min_out;
+    if (*end == ':') *max_out = strtod(end + 1, &end);
+
+    return end != text && *end == '\0' &&
+        *min_out >= 0 && *min_out <= *max_out && *max_out <= 1;
+}
+
+static bool parseSeed(const char *text, uint64_t *seed_out) {
+    char *end;
+
+    errno = 0;
+    *seed_out = strtoull(text, &end, 0);
+
+    return errno == 0 && end != text && *end == '\0';
+}
+
+// "A:B:C...", one value per choice; returns how many, or 0 if malformed
+static int parseChoiceList(char *text, int *values_out) {
+    char *save;
+    char *value;
+    int count = 0;
+
+    for (value = strtok_r(text, ":", &save); value != NULL; value = strtok_r(NULL, ":", &save)) {
+        if (count == MAX_CHOICES || !parseInt(value, &values_out[count])) return 0;
+        count++;
+    }
+
+    return count;
+}
+
+// the lists given must all have one entry per choice, and set the count
+// when choices= doesn't
+static bool checkChoiceList(int count, int *choice_count) {
+    if (count == 0) return false;
+    if (*choice_count == 0) *choice_count = count;
 
-    if (!StateMachine_init(&machine)) {
+    return count == *choice_count;
+}
+
+static bool parseStation(char *spec, int id, StationConfig *config_out) {
+    char *save;
+    char *field;
+    char *value;
+    int choice_count = 0;
+    int i;
+
+    defaultStationConfig(config_out);
+    config_out->id = id;
+
+    for (field = strtok_r(spec, ",", &save); field != NULL; field = strtok_r(NULL, ",", &save)) {
+        value = strchr(field, '=');
+        if (value == NULL) return false;
+        *value++ = '\0';
+
+        if (strcmp(field, "chip") == 0) {
+            config_out->gpio_chip = value;
+        } else if (strcmp(field, "choices") == 0) {
+            if (!parseInt(value, &i) || !checkChoiceList(i, &choice_count)) return false;
+        } else if (strcmp(field, "leds") == 0) {
+            if (!checkChoiceList(parseChoiceList(value, config_out->led_pins), &choice_count)) return false;
+        } else if (strcmp(field, "buttons") == 0) {
+            if (!checkChoiceList(parseChoiceList(value, config_out->button_pins), &choice_count)) return false;
+        } else if (strcmp(field, "tones") == 0) {
+            if (!checkChoiceList(parseChoiceList(value, config_out->tone_freqs), &choice_count)) return false;
+        } else if (strcmp(field, "pwm") == 0) {
+            if (strcmp(value, "none") == 0) {
+                config_out->pwm_channel = NO_PWM_CHANNEL;
+            } else if (!parseInt(value, &config_out->pwm_channel)) {
+                return false;
+            }
+        } else if (strcmp(field, "audio") == 0) {
+            config_out->audio_output = strcmp(value, "none") == 0 ? NULL : value;
+        } else {
+            return false;
+        }
+    }
+
+    if (choice_count != 0) config_out->choice_count = choice_count;
+    if (config_out->choice_count < 2 || config_out->choice_count > MAX_CHOICES) return false;
+    for (i = 0; i < config_out->choice_count; i++) {
+        if (config_out->tone_freqs[i] <= 0) return false;
+    }
+
+    return true;
+}
+
+static bool parseOptions(int argc, char **argv, Options *options_out) {
+    const char *env_seed;
+    int priority_min, priority_max;
+    int value;
+    int i;
+
+    options_out->log_games = false;
+    options_out->realtime = false;
+    options_out->threaded_input = false;
+    options_out->realtime_cpu = REALTIME_ANY_CPU;
+    options_out->realtime_priority = REALTIME_DEFAULT_PRIORITY;
+    options_out->station_count = 0;
+    options_out->record_path = NULL;
+    options_out->replay_path = NULL;
+    options_out->replay_real_time = false;
+    options_out->batch_sessions = 0;
+    options_out->batch_games = DEFAULT_BATCH_GAMES;
+    options_out->error_rate_min = DEFAULT_ERROR_RATE;
+    options_out->error_rate_max = DEFAULT_ERROR_RATE;
+    options_out->reaction_min_ms = DEFAULT_REACTION_MIN_MS;
+    options_out->reaction_max_ms = DEFAULT_REACTION_MAX_MS;
+    options_out->batch_check = false;
+    options_out->bench_games = 0;
+    options_out->idle_after = DEFAULT_IDLE_AFTER_S * NS_PER_SEC;
+    options_out->attract_period = 0;
+    options_out->telemetry_name = NULL;
+    options_out->scores_path = NULL;
+#ifdef GAME_TRACE
+    options_out->trace_path = NULL;
+#endif
+
+    env_seed = getenv("GAME_SEED");
+    if (env_seed != NULL) {
+        if (!parseSeed(env_seed, &options_out->seed)) {
+            fprintf(stderr, "Invalid GAME_SEED \"%s\"\n", env_seed);
+            return false;
+        }
+    } else if (getrandom(&options_out->seed, sizeof(options_out->seed), 0) != sizeof(options_out->seed)) {
+        options_out->seed = Rng_mix((uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32));
+    }
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            if (!parseSeed(argv[++i], &options_out->seed)) {
+                fprintf(stderr, "Invalid seed \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--log-games") == 0) {
+            options_out->log_games = true;
+        } else if (strcmp(argv[i], "--threaded-input") == 0) {
+            options_out->threaded_input = true;
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            options_out->realtime = true;
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            if (!parseInt(argv[++i], &options_out->realtime_cpu)) {
+                fprintf(stderr, "Invalid cpu \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--rt-priority") == 0 && i + 1 < argc) {
+            if (!parseInt(argv[++i], &options_out->realtime_priority)) {
+                fprintf(stderr, "Invalid priority \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            options_out->record_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            options_out->replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "real") == 0) {
+                options_out->replay_real_time = true;
+            } else if (strcmp(argv[i], "full") != 0) {
+                fprintf(stderr, "Invalid replay speed \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            if (!parseCount(argv[++i], &options_out->batch_sessions)) {
+                fprintf(stderr, "Invalid session count \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--batch-games") == 0 && i + 1 < argc) {
+            if (!parseCount(argv[++i], &options_out->batch_games)) {
+                fprintf(stderr, "Invalid game count \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--error-rate") == 0 && i + 1 < argc) {
+            if (!parseRate(argv[++i], &options_out->error_rate_min, &options_out->error_rate_max)) {
+                fprintf(stderr, "Invalid error rate \"%s\"\n", argv[i]);
+                return false;
+            }
+            // a session only ends on a wrong press
+            if (BatchSim_errorThreshold(options_out->error_rate_min) == 0) {
+                fprintf(stderr, "Error rate \"%s\" never presses wrong, so games never end; "
+                    "it must be at least %g\n", argv[i], 1 / 4294967296.0);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--reaction-ms") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d:%d", &options_out->reaction_min_ms, &options_out->reaction_max_ms) != 2 ||
+                options_out->reaction_min_ms < 0 ||
+                options_out->reaction_max_ms <= options_out->reaction_min_ms ||
+                options_out->reaction_max_ms - options_out->reaction_min_ms > 4000) {
+                fprintf(stderr, "Invalid reaction time range \"%s\"\n", argv[i]);
+                return false;
+            }
+#ifdef GAME_TRACE
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            options_out->trace_path = argv[++i];
+#endif
+        } else if (strcmp(argv[i], "--telemetry") == 0 && i + 1 < argc) {
+            options_out->telemetry_name = argv[++i];
+        } else if (strcmp(argv[i], "--scores") == 0 && i + 1 < argc) {
+            options_out->scores_path = argv[++i];
+        } else if (strcmp(argv[i], "--batch-check") == 0) {
+            options_out->batch_check = true;
+        } else if (strcmp(argv[i], "--bench-dispatch") == 0 && i + 1 < argc) {
+            if (!parseCount(argv[++i], &options_out->bench_games)) {
+                fprintf(stderr, "Invalid game count \"%s\"\n", argv[i]);
+                return false;
+            }
+        } else if (strcmp(argv[i], "--idle-after") == 0 && i + 1 < argc) {
+            if (!parseInt(argv[++i], &value)) {
+                fprintf(stderr, "Invalid idle time \"%s\"\n", argv[i]);
+                return false;
+            }
+            options_out->idle_after = value * NS_PER_SEC;
+        } else if (strcmp(argv[i], "--attract-ms") == 0 && i + 1 < argc) {
+            if (!parseInt(argv[++i], &value)) {
+                fprintf(stderr, "Invalid attract step \"%s\"\n", argv[i]);
+                return false;
+            }
+            options_out->attract_period = value * (NS_PER_SEC / 1000);
+        } else if (strcmp(argv[i], "--station") == 0 && i + 1 < argc) {
+            if (options_out->station_count >= MAX_STATIONS) {
+                fprintf(stderr, "At most %d stations are supported\n", MAX_STATIONS);
+                return false;
+            }
+            // fields point into argv, which outlives the options
+            if (!parseStation(argv[++i], options_out->station_count,
+                    &options_out->stations[options_out->station_count])) {
+                fprintf(stderr, "Invalid station \"%s\"\n", argv[i]);
+                return false;
+            }
+            options_out->station_count++;
+        } else {
+            printUsage(argv[0]);
+            return false;
+        }
+    }
+
+    if (options_out->record_path != NULL && options_out->replay_path != NULL) {
+        fprintf(stderr, "--record and --replay can't be combined\n");
+        return false;
+    }
+
+    // capture threads run one above the game loop
+    priority_min = sched_get_priority_min(SCHED_FIFO);
+    priority_max = sched_get_priority_max(SCHED_FIFO) - (options_out->threaded_input ? 1 : 0);
+    if (options_out->realtime_priority < priority_min || options_out->realtime_priority > priority_max) {
+        fprintf(stderr, "--rt-priority must be %d to %d%s\n", priority_min, priority_max,
+            options_out->threaded_input ? " with --threaded-input" : "");
+        printUsage(argv[0]);
+        return false;
+    }
+
+    if (options_out->station_count == 0) {
+        defaultStationConfig(&options_out->stations[0]);
+        options_out->station_count = 1;
+    }
+
+    return true;
+}
+
+static int replay(Options *options) {
+    Recording recording;
+    Engine engine;
+    bool identical;
+    int i;
+
+    if (!Recording_open(&recording, options->replay_path)) return 1;
+
+    if (recording.header->station_count > MAX_STATIONS) {
+        fprintf(stderr, "Recording has too many stations\n");
+        Recording_close(&recording);
+        return 1;
+    }
+    // stations not given on the command line get the backend's defaults,
+    // but always the recorded number of choices
+    options->seed = recording.header->seed;
+    // replayed games were already kept when they were played
+    options->scores_path = NULL;
+    options->idle_after = recording.header->idle_after;
+    options->attract_period = recording.header->attract_period;
+    while (options->station_count < (int) recording.header->station_count) {
+        defaultStationConfig(&options->stations[options->station_count]);
+        options->stations[options->station_count].id = options->station_count;
+        options->station_count++;
+    }
+    for (i = 0; i < (int) recording.header->station_count; i++) {
+        if (recording.header->choice_counts[i] < 2 || recording.header->choice_counts[i] > MAX_CHOICES) {
+            fprintf(stderr, "Recording has an invalid choice count for station %d\n", i);
+            Recording_close(&recording);
+            return 1;
+        }
+        options->stations[i].choice_count = recording.header->choice_counts[i];
+    }
+
+    if (!Engine_init(&engine, options)) {
+        fprintf(stderr, "Failed to initialize game!\n");
+        Recording_close(&recording);
+        return 1;
+    }
+
+    identical = Engine_replay(&engine, &recording, options->replay_real_time);
+    Engine_printStats(&engine);
+#ifdef GAME_TRACE
+    if (options->trace_path != NULL) Trace_export(options->trace_path);
+#endif
+    Engine_deinit(&engine);
+    Recording_close(&recording);
+
+    return identical ? 0 : 1;
+}
+
+// Plays one batch session on the real state machine, with the same synthetic
+// player driving it, and checks it ends up where the batch kernel left it.
+static bool checkSession(const BatchSim *sim, size_t session, const BatchPlayer *player,
+    uint64_t seed, uint64_t games, StateMachine *machine) {
+    Timer *timer_heap[TIMER_TAG_COUNT];
+    TimerQueue timer_queue;
+    uint64_t player_seed = BatchSim_playerSeed(seed, session);
+    uint64_t presses = 0, rounds_total = 0, best_round = 0;
+    uint64_t draw;
+    Choice correct;
+    Timer *next_timer;
+
+    TimerQueue_init(&timer_queue, timer_heap, TIMER_TAG_COUNT);
+    StateMachine_initDetached(machine, 0, DEFAULT_CHOICE_COUNT, BatchSim_gameSeed(seed, session), false,
+        &timer_queue);
+
+    machine->now = 0;
+    StateMachine_dispatch(machine, signal_enter);
+    while (machine->games_played < games) {
+        if (machine->state == state_wait_for_input) {
+            draw = BatchPlayer_draw(player_seed, presses++);
+            correct = StateMachine_sequenceAt(machine, machine->cur_sequence_index);
+            machine->now += BatchPlayer_reaction(player, draw);
+            machine->input_event.type = event_button_down;
+            machine->input_event.choice = correct;
+            machine->input_event.timestamp = machine->now;
+            if (BatchPlayer_wrong(draw, sim->error_threshold[session])) {
+                machine->input_event.choice = (correct + 1) % machine->choice_count;
+                rounds_total += machine->sequence_len;
+                if (machine->sequence_len > best_round) best_round = machine->sequence_len;
+            }
+            StateMachine_dispatch(machine, signal_input);
+        } else if (machine->state == state_play_correct_choice) {
+            machine->now += BATCH_PRESS_DURATION;
+            machine->input_event.type = event_button_up;
+            machine->input_event.timestamp = machine->now;
+            StateMachine_dispatch(machine, signal_input);
+        } else {
+            next_timer = TimerQueue_peek(&timer_queue);
+            if (next_timer == NULL) {
+                fprintf(stderr, "batch check: session %zu stuck in state %d\n", session, machine->state);
+                return false;
+            }
+            machine->now = next_timer->deadline;
+            machine->timeout_tag = TimerQueue_popExpired(&timer_queue, machine->now)->tag;
+            StateMachine_dispatch(machine, signal_timeout);
+        }
+    }
+
+    if (machine->state != sim->state[session] ||
+        machine->sequence_len != sim->sequence_len[session] ||
+        machine->cur_sequence_index != sim->cur_sequence_index[session] ||
+        machine->game_seed != sim->game_seed[session] ||
+        machine->games_played != sim->games[session] ||
+        machine->transitions != sim->transitions[session] ||
+        machine->now != sim->now[session] ||
+        presses != sim->presses[session] ||
+        rounds_total != sim->rounds_total[session] ||
+        best_round != sim->best_round[session]) {
+        fprintf(stderr, "batch check: session %zu differs: "
+            "state %d/%llu, transitions %llu/%llu, time %lld/%lld, rounds %llu/%llu\n",
+            session,
+            machine->state, (unsigned long long) sim->state[session],
+            machine->transitions, (unsigned long long) sim->transitions[session],
+            (long long) machine->now, (long long) sim->now[session],
+            (unsigned long long) rounds_total, (unsigned long long) sim->rounds_total[session]);
+        return false;
+    }
+
+    return true;
+}
+
+static double secondsSince(const struct timespec *start) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void printBatchSummary(const BatchSim *sim, const Options *options) {
+    uint64_t games, rounds, best, transitions = 0;
+    int64_t played_for;
+    size_t bucket, begin, end, i;
+    size_t buckets = sim->count < BATCH_SUMMARY_ROWS ? sim->count : BATCH_SUMMARY_ROWS;
+
+    for (i = 0; i < sim->count; i++) transitions += sim->transitions[i];
+    fprintf(stderr, "%zu sessions, %llu games, %llu transitions\n",
+        sim->count, (unsigned long long) (sim->count * options->batch_games),
+        (unsigned long long) transitions);
+    fprintf(stderr, "error rate  mean round  best round  mean game\n");
+
+    // sessions are in order of error rate, so consecutive ones share a row
+    for (bucket = 0; bucket < buckets; bucket++) {
+        begin = sim->count * bucket / buckets;
+        end = sim->count * (bucket + 1) / buckets;
+        games = rounds = best = 0;
+        played_for = 0;
+        for (i = begin; i < end; i++) {
+            games += sim->games[i];
+            rounds += sim->rounds_total[i];
+            played_for += sim->now[i];
+            if (sim->best_round[i] > best) best = sim->best_round[i];
+        }
+        fprintf(stderr, "%9.2f%%  %10.2f  %10llu  %8.1fs\n",
+            100.0 * sim->error_threshold[begin] / 4294967296.0,
+            (double) rounds / games,
+            (unsigned long long) best,
+            (double) played_for / games / NS_PER_SEC);
+    }
+}
+
+static int runBatch(const Options *options) {
+    BatchSim sim;
+    BatchPlayer player;
+    StateMachine *machine;
+    struct timespec started;
+    double elapsed;
+    size_t i;
+    bool matches = true;
+
+    player.reaction_min = (Nanoseconds) options->reaction_min_ms * (NS_PER_SEC / 1000);
+    player.reaction_spread = (uint32_t) ((Nanoseconds) (options->reaction_max_ms - options->reaction_min_ms) *
+        (NS_PER_SEC / 1000));
+
+    if (!BatchSim_init(&sim, options->batch_sessions, options->seed,
+            options->error_rate_min, options->error_rate_max)) {
+        fprintf(stderr, "Failed to allocate %llu sessions\n", (unsigned long long) options->batch_sessions);
+        return 1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    BatchSim_run(&sim, &player, options->batch_games);
+    elapsed = secondsSince(&started);
+    printBatchSummary(&sim, options);
+    fprintf(stderr, "batch: %.3fs (%.0f games/s)\n", elapsed, sim.count * options->batch_games / elapsed);
+
+    if (options->batch_check) {
+        machine = (StateMachine *) malloc(sizeof(StateMachine));
+        if (machine == NULL) {
+            BatchSim_deinit(&sim);
+            return 1;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &started);
+        for (i = 0; i < sim.count && matches; i++) {
+            matches = checkSession(&sim, i, &player, options->seed, options->batch_games, machine);
+        }
+        elapsed = secondsSince(&started);
+        fprintf(stderr, "state machine: %.3fs (%.0f games/s), %s\n", elapsed,
+            i * options->batch_games / elapsed,
+            matches ? "every session matches" : "mismatch");
+        free(machine);
+    }
+
+    BatchSim_deinit(&sim);
+
+    return matches ? 0 : 1;
+}
+
+// Plays games on a detached machine, with the batch player scripting the
+// input, dispatching through the table or the handlers. Returns the seconds
+// it took.
+static inline double benchGames(StateMachine *machine, const BatchPlayer *player, uint32_t error_threshold,
+    uint64_t seed, uint64_t games, bool use_table) {
+    Timer *timer_heap[TIMER_TAG_COUNT];
+    TimerQueue timer_queue;
+    uint64_t player_seed = BatchSim_playerSeed(seed, 0);
+    uint64_t presses = 0;
+    uint64_t draw;
+    Choice correct;
+    Timer *expired;
+    struct timespec started;
+
+    TimerQueue_init(&timer_queue, timer_heap, TIMER_TAG_COUNT);
+    StateMachine_initDetached(machine, 0, DEFAULT_CHOICE_COUNT, BatchSim_gameSeed(seed, 0), false,
+        &timer_queue);
+    clock_gettime(CLOCK_MONOTONIC, &started);
+
+    machine->now = 0;
+    StateMachine_dispatchVia(machine, signal_enter, use_table);
+    while (machine->games_played < games) {
+        if (machine->state == state_wait_for_input) {
+            draw = BatchPlayer_draw(player_seed, presses++);
+            correct = StateMachine_sequenceAt(machine, machine->cur_sequence_index);
+            machine->now += BatchPlayer_reaction(player, draw);
+            machine->input_event.type = event_button_down;
+            machine->input_event.choice = BatchPlayer_wrong(draw, error_threshold) ?
+                (correct + 1) % machine->choice_count :
+                correct;
+            machine->input_event.timestamp = machine->now;
+        } else if (machine->state == state_play_correct_choice) {
+            machine->now += BATCH_PRESS_DURATION;
+            machine->input_event.type = event_button_up;
+            machine->input_event.timestamp = machine->now;
+        } else {
+            // every other state is waiting on a timer
+            expired = TimerQueue_popExpired(&timer_queue, INT64_MAX);
+            machine->now = expired->deadline;
+            machine->timeout_tag = expired->tag;
+            StateMachine_dispatchVia(machine, signal_timeout, use_table);
+            continue;
+        }
+        StateMachine_dispatchVia(machine, signal_input, use_table);
+    }
+
+    return secondsSince(&started);
+}
+
+static int benchDispatch(const Options *options) {
+    BatchPlayer player;
+    StateMachine *machine;
+    // nonzero, or benchGames would never finish a game: --error-rate
+    // rejects rates that round to 0, as for the batch simulator
+    uint32_t error_threshold = BatchSim_errorThreshold(options->error_rate_min);
+    double elapsed[2] = { 0, 0 };
+    double seconds;
+    unsigned long long transitions[2] = { 0, 0 };
+    uint64_t end_seed[2] = { 0, 0 };
+    int run, table;
+
+    player.reaction_min = (Nanoseconds) options->reaction_min_ms * (NS_PER_SEC / 1000);
+    player.reaction_spread = (uint32_t) ((Nanoseconds) (options->reaction_max_ms - options->reaction_min_ms) *
+        (NS_PER_SEC / 1000));
+
+    machine = (StateMachine *) malloc(sizeof(StateMachine));
+    if (machine == NULL) return 1;
+
+    // alternating, best of each, so neither side gets the warm caches
+    for (run = 0; run < BENCH_DISPATCH_RUNS; run++) {
+        for (table = 0; table < 2; table++) {
+            if (table) {
+                seconds = benchGames(machine, &player, error_threshold, options->seed, options->bench_games, true);
+            } else {
+                seconds = benchGames(machine, &player, error_threshold, options->seed, options->bench_games, false);
+            }
+            if (run == 0 || seconds < elapsed[table]) elapsed[table] = seconds;
+            transitions[table] = machine->transitions;
+            end_seed[table] = machine->game_seed;
+        }
+    }
+    free(machine);
+
+    fprintf(stderr, "handlers: %llu transitions in %.3fs (%.0f transitions/s)\n",
+        transitions[0], elapsed[0], transitions[0] / elapsed[0]);
+    fprintf(stderr, "table:    %llu transitions in %.3fs (%.0f transitions/s, %.2fx)\n",
+        transitions[1], elapsed[1], transitions[1] / elapsed[1], elapsed[0] / elapsed[1]);
+    if (transitions[0] != transitions[1] || end_seed[0] != end_seed[1]) {
+        fprintf(stderr, "mismatch: the table and the handlers played different games\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    Engine engine;
+    Options options;
+
+    if (!parseOptions(argc, argv, &options)) {
+        return 2;
+    }
+
+    if (options.replay_path != NULL) {
+        return replay(&options);
+    }
+    if (options.batch_sessions > 0) {
+        return runBatch(&options);
+    }
+    if (options.bench_games > 0) {
+        return benchDispatch(&options);
+    }
+
+    if (!Engine_init(&engine, &options)) {
         fprintf(stderr, "Failed to initialize game!\n");
         return 1;
     }
 
-    StateMachine_run(&machine);
+    // after init, so the devices' buffers are locked in too
+    if (options.realtime && !enableRealtime(options.realtime_cpu, options.realtime_priority)) {
+        fprintf(stderr, "Continuing without full real-time setup\n");
+    }
+    // capture threads were started before and keep their own cpus; one step
+    // above the game loop, so they preempt it mid-output
+    if (options.realtime && options.threaded_input) {
+        Engine_raiseCapturePriority(&engine, options.realtime_priority + 1);
+    }
+
+    Engine_run(&engine);
+    Engine_printStats(&engine);
+    Engine_deinit(&engine);
+#ifdef GAME_TRACE
+    if (options.trace_path != NULL) Trace_export(options.trace_path);
+#endif
     
     return 0;
 }
@@ -0,0 +1,599 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#ifdef HAVE_ALSA
+#include <alsa/asoundlib.h>
+#endif
+
+#include "pcm_audio.h"
+#include "realtime.h"
+
+// frames mixed at a time
+#define PCM_BLOCK 1024
+// wavetables hold about this long of their tone, rounded to whole periods
+#define TABLE_MS 100
+// per voice, so PCM_AUDIO_VOICES overlapping tones can't clip
+#define AMPLITUDE 0.25f
+#define WAV_HEADER_LEN 44
+#define COMMAND_RING_SIZE 64
+#define STOP_COMMAND -1
+
+typedef struct {
+    const float *table;
+    int table_len;
+    int pos;
+    float gain;
+    float gain_step;
+    // frames left on the current envelope ramp, 0 while sustaining
+    int ramp_left;
+    bool releasing;
+    bool active;
+} Voice;
+
+typedef struct {
+    Nanoseconds at;
+    // STOP_COMMAND to stop
+    int choice;
+} Command;
+
+struct PcmAudio {
+    float *tables[MAX_CHOICES];
+    int table_len[MAX_CHOICES];
+    int table_count;
+    Voice voices[PCM_AUDIO_VOICES];
+    int attack_frames;
+    int release_frames;
+    Nanoseconds started_at;
+    float mix[PCM_BLOCK];
+    int16_t out[PCM_BLOCK];
+    // file sinks: frames written so far
+    int fd;
+    uint64_t frames;
+    bool failed;
+    // a regular file, where silence can be skipped over as a hole
+    bool seekable;
+    // requests go to a render thread through the ring
+    bool threaded;
+    pthread_t thread;
+    // a file sink's render thread waits on it for requests
+    int wakeup_fd;
+#ifdef HAVE_ALSA
+    snd_pcm_t *alsa;
+    int period_frames;
+#endif
+    // written only by the caller
+    _Alignas(64) uint32_t head;
+    bool stopping;
+    // written only by the render thread
+    _Alignas(64) uint32_t tail;
+    Command ring[COMMAND_RING_SIZE];
+};
+
+static bool buildTables(PcmAudio *pcm, const int *freqs, int count) {
+    long periods;
+    int len, c, i;
+
+    for (c = 0; c < count; c++) {
+        periods = lround((double) freqs[c] * TABLE_MS / 1000);
+        if (periods < 1) periods = 1;
+        len = (int) lround((double) periods * PCM_AUDIO_RATE / freqs[c]);
+
+        pcm->tables[c] = (float *) malloc(len * sizeof(float));
+        if (pcm->tables[c] == NULL) return false;
+        pcm->table_len[c] = len;
+        pcm->table_count = c + 1;
+        for (i = 0; i < len; i++) {
+            pcm->tables[c][i] = AMPLITUDE * (float) sin(2 * M_PI * periods * i / len);
+        }
+    }
+
+    return true;
+}
+
+static void mixVoice(Voice *voice, float *mix, int count) {
+    const float *src;
+    float *dst;
+    float gain, step;
+    int done = 0;
+    int n, i;
+
+    while (done < count && voice->active) {
+        // stop at the end of the wavetable and of the ramp so the inner
+        // loops run over plain contiguous arrays
+        n = count - done;
+        if (n > voice->table_len - voice->pos) n = voice->table_len - voice->pos;
+        if (voice->ramp_left > 0 && n > voice->ramp_left) n = voice->ramp_left;
+        src = voice->table + voice->pos;
+        dst = mix + done;
+        gain = voice->gain;
+
+        if (voice->ramp_left > 0) {
+            step = voice->gain_step;
+#pragma GCC ivdep
+            for (i = 0; i < n; i++) {
+                dst[i] += src[i] * (gain + step * (float) i);
+            }
+            voice->gain += step * n;
+            voice->ramp_left -= n;
+            if (voice->ramp_left == 0) {
+                voice->gain = voice->releasing ? 0 : 1;
+                voice->active = !voice->releasing;
+            }
+        } else {
+#pragma GCC ivdep
+            for (i = 0; i < n; i++) {
+                dst[i] += src[i] * gain;
+            }
+        }
+
+        voice->pos = (voice->pos + n) % voice->table_len;
+        done += n;
+    }
+}
+
+static void render(PcmAudio *pcm, int16_t *out, int count) {
+    float *mix = pcm->mix;
+    float sample;
+    int i;
+
+    memset(mix, 0, count * sizeof(float));
+    for (i = 0; i < PCM_AUDIO_VOICES; i++) {
+        if (pcm->voices[i].active) mixVoice(&pcm->voices[i], mix, count);
+    }
+
+    for (i = 0; i < count; i++) {
+        sample = mix[i] * 32767.0f;
+        sample = sample > 32767.0f ? 32767.0f : sample;
+        sample = sample < -32768.0f ? -32768.0f : sample;
+        out[i] = (int16_t) sample;
+    }
+}
+
+static void release(PcmAudio *pcm) {
+    Voice *voice;
+    int i;
+
+    for (i = 0; i < PCM_AUDIO_VOICES; i++) {
+        voice = &pcm->voices[i];
+        if (!voice->active || voice->releasing) continue;
+        voice->releasing = true;
+        voice->ramp_left = pcm->release_frames;
+        voice->gain_step = -voice->gain / pcm->release_frames;
+    }
+}
+
+// the tone playing fades out under the new one rather than cutting off
+static void attack(PcmAudio *pcm, Choice choice) {
+    Voice *voice = &pcm->voices[0];
+    int i;
+
+    release(pcm);
+    for (i = 0; i < PCM_AUDIO_VOICES; i++) {
+        if (!pcm->voices[i].active) {
+            voice = &pcm->voices[i];
+            break;
+        }
+        if (pcm->voices[i].gain < voice->gain) voice = &pcm->voices[i];
+    }
+
+    voice->table = pcm->tables[choice];
+    voice->table_len = pcm->table_len[choice];
+    voice->pos = 0;
+    voice->gain = 0;
+    voice->gain_step = 1.0f / pcm->attack_frames;
+    voice->ramp_left = pcm->attack_frames;
+    voice->releasing = false;
+    voice->active = true;
+}
+
+static void apply(PcmAudio *pcm, int choice) {
+    if (choice == STOP_COMMAND) {
+        release(pcm);
+    } else {
+        attack(pcm, (Choice) choice);
+    }
+}
+
+static int64_t framesIn(Nanoseconds duration) {
+    if (duration <= 0) return 0;
+
+    // split so days of runtime can't overflow
+    return duration / NS_PER_SEC * PCM_AUDIO_RATE + duration % NS_PER_SEC * PCM_AUDIO_RATE / NS_PER_SEC;
+}
+
+static void putLe(uint8_t *dst, uint32_t value, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        dst[i] = (uint8_t) (value >> (8 * i));
+    }
+}
+
+static void wavHeader(uint8_t *header, uint64_t frames) {
+    uint64_t data_len = frames * sizeof(int16_t);
+    // a stream's length isn't known up front, players accept the maximum
+    uint32_t len = data_len > UINT32_MAX - WAV_HEADER_LEN ? UINT32_MAX : (uint32_t) data_len;
+
+    memcpy(header, "RIFF", 4);
+    putLe(header + 4, len == UINT32_MAX ? len : len + WAV_HEADER_LEN - 8, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    putLe(header + 16, 16, 4);
+    putLe(header + 20, 1, 2);
+    putLe(header + 22, 1, 2);
+    putLe(header + 24, PCM_AUDIO_RATE, 4);
+    putLe(header + 28, PCM_AUDIO_RATE * sizeof(int16_t), 4);
+    putLe(header + 32, sizeof(int16_t), 2);
+    putLe(header + 34, 16, 2);
+    memcpy(header + 36, "data", 4);
+    putLe(header + 40, len, 4);
+}
+
+static void writeAll(PcmAudio *pcm, const void *buf, size_t len) {
+    const char *pos = (const char *) buf;
+    ssize_t written;
+
+    while (len > 0 && !pcm->failed) {
+        written = write(pcm->fd, pos, len);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to write audio: %s\n", strerror(errno));
+            pcm->failed = true;
+            return;
+        }
+        pos += written;
+        len -= written;
+    }
+}
+
+static bool silent(const PcmAudio *pcm) {
+    int i;
+
+    for (i = 0; i < PCM_AUDIO_VOICES; i++) {
+        if (pcm->voices[i].active) return false;
+    }
+
+    return true;
+}
+
+// everything up to the sample playing at `at` goes out before the request
+// takes effect
+static void renderUntil(PcmAudio *pcm, Nanoseconds at) {
+    uint64_t until = framesIn(at - pcm->started_at);
+    int count;
+
+    while (pcm->frames < until && !pcm->failed) {
+        // the gap between tones, however long, costs one seek
+        if (pcm->seekable && silent(pcm)) {
+            if (lseek(pcm->fd, (until - pcm->frames) * sizeof(int16_t), SEEK_CUR) < 0) {
+                fprintf(stderr, "Failed to write audio: %s\n", strerror(errno));
+                pcm->failed = true;
+            }
+            pcm->frames = until;
+            break;
+        }
+        count = until - pcm->frames > PCM_BLOCK ? PCM_BLOCK : (int) (until - pcm->frames);
+        render(pcm, pcm->out, count);
+        writeAll(pcm, pcm->out, count * sizeof(int16_t));
+        pcm->frames += count;
+    }
+}
+
+static bool openFile(PcmAudio *pcm, const char *path) {
+    uint8_t header[WAV_HEADER_LEN];
+
+    if (strcmp(path, "-") == 0) {
+        pcm->fd = STDOUT_FILENO;
+    } else {
+        pcm->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (pcm->fd < 0) {
+            fprintf(stderr, "Failed to open \"%s\": %s\n", path, strerror(errno));
+            return false;
+        }
+    }
+
+    wavHeader(header, UINT64_MAX);
+    writeAll(pcm, header, sizeof(header));
+    pcm->seekable = lseek(pcm->fd, 0, SEEK_CUR) >= 0;
+
+    return !pcm->failed;
+}
+
+// fill in the real lengths if the sink can seek back to the header
+static void closeFile(PcmAudio *pcm) {
+    uint8_t header[WAV_HEADER_LEN];
+
+    if (!pcm->failed && pcm->seekable) {
+        wavHeader(header, pcm->frames);
+        // trailing silence is still a hole past the end of the file
+        if (ftruncate(pcm->fd, WAV_HEADER_LEN + pcm->frames * sizeof(int16_t)) < 0 ||
+            pwrite(pcm->fd, header, sizeof(header), 0) != sizeof(header)) {
+            fprintf(stderr, "Failed to finish WAV header: %s\n", strerror(errno));
+        }
+    }
+    if (pcm->fd != STDOUT_FILENO) close(pcm->fd);
+}
+
+static void wakeUp(int fd) {
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static void push(PcmAudio *pcm, Nanoseconds at, int choice) {
+    uint32_t head = pcm->head;
+    uint32_t tail = __atomic_load_n(&pcm->tail, __ATOMIC_ACQUIRE);
+
+    if (head - tail == COMMAND_RING_SIZE) {
+        fprintf(stderr, "Audio commands backed up, dropping tone\n");
+        return;
+    }
+
+    pcm->ring[head & (COMMAND_RING_SIZE - 1)].at = at;
+    pcm->ring[head & (COMMAND_RING_SIZE - 1)].choice = choice;
+    __atomic_store_n(&pcm->head, head + 1, __ATOMIC_RELEASE);
+    if (pcm->wakeup_fd >= 0) wakeUp(pcm->wakeup_fd);
+}
+
+// Renders a file sink's requests as they come, so a long stretch between
+// two of them, or a pipe reader falling behind, holds up this thread rather
+// than the game loop.
+static void *fileLoop(void *arg) {
+    PcmAudio *pcm = (PcmAudio *) arg;
+    struct pollfd fds[1];
+    const Command *cmd;
+    uint64_t count;
+    uint32_t tail;
+    bool stopping;
+
+    blockThreadSignals();
+    fds[0].fd = pcm->wakeup_fd;
+    fds[0].events = POLLIN;
+
+    for (;;) {
+        // read first, so the requests made before stopping all get played
+        stopping = __atomic_load_n(&pcm->stopping, __ATOMIC_ACQUIRE);
+        tail = pcm->tail;
+        while (tail != __atomic_load_n(&pcm->head, __ATOMIC_ACQUIRE)) {
+            cmd = &pcm->ring[tail & (COMMAND_RING_SIZE - 1)];
+            renderUntil(pcm, cmd->at);
+            apply(pcm, cmd->choice);
+            tail++;
+            __atomic_store_n(&pcm->tail, tail, __ATOMIC_RELEASE);
+        }
+        if (stopping) break;
+
+        if (poll(fds, 1, -1) < 0 && errno != EINTR) {
+            fprintf(stderr, "Failed to wait for audio requests: %s\n", strerror(errno));
+            break;
+        }
+        if (read(pcm->wakeup_fd, &count, sizeof(count)) < 0) count = 0;
+    }
+
+    return NULL;
+}
+
+static bool startFileThread(PcmAudio *pcm) {
+    int err;
+
+    pcm->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pcm->wakeup_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        return false;
+    }
+    err = pthread_create(&pcm->thread, NULL, fileLoop, pcm);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start audio thread: %s\n", strerror(err));
+        close(pcm->wakeup_fd);
+        pcm->wakeup_fd = -1;
+        return false;
+    }
+    pcm->threaded = true;
+
+    return true;
+}
+
+static void stopThread(PcmAudio *pcm) {
+    __atomic_store_n(&pcm->stopping, true, __ATOMIC_RELEASE);
+    if (pcm->wakeup_fd >= 0) wakeUp(pcm->wakeup_fd);
+    pthread_join(pcm->thread, NULL);
+    if (pcm->wakeup_fd >= 0) close(pcm->wakeup_fd);
+}
+
+#ifdef HAVE_ALSA
+
+// Each pass renders one period. snd_pcm_delay says how far behind the
+// period's first frame will play, so a request lands on the frame playing
+// PCM_AUDIO_LATENCY after it was made; requests due in a later period wait.
+static void *alsaLoop(void *arg) {
+    PcmAudio *pcm = (PcmAudio *) arg;
+    int period = pcm->period_frames;
+    snd_pcm_sframes_t delay, written;
+    Nanoseconds period_at;
+    const Command *cmd;
+    uint32_t tail;
+    int64_t offset;
+    int done;
+
+    blockThreadSignals();
+    while (!__atomic_load_n(&pcm->stopping, __ATOMIC_ACQUIRE)) {
+        if (snd_pcm_delay(pcm->alsa, &delay) < 0) delay = 0;
+        period_at = nanoTimestamp() + delay * NS_PER_SEC / PCM_AUDIO_RATE;
+
+        done = 0;
+        tail = pcm->tail;
+        while (tail != __atomic_load_n(&pcm->head, __ATOMIC_ACQUIRE)) {
+            cmd = &pcm->ring[tail & (COMMAND_RING_SIZE - 1)];
+            offset = framesIn(cmd->at + PCM_AUDIO_LATENCY - period_at);
+            if (offset >= period) break;
+            if (offset > done) {
+                render(pcm, pcm->out + done, (int) offset - done);
+                done = (int) offset;
+            }
+            apply(pcm, cmd->choice);
+            tail++;
+            __atomic_store_n(&pcm->tail, tail, __ATOMIC_RELEASE);
+        }
+        render(pcm, pcm->out + done, period - done);
+
+        done = 0;
+        while (done < period) {
+            written = snd_pcm_writei(pcm->alsa, pcm->out + done, period - done);
+            if (written < 0) {
+                // an underrun costs a gap, not the station's sound
+                if (snd_pcm_recover(pcm->alsa, (int) written, 1) < 0) {
+                    fprintf(stderr, "Failed to write audio: %s\n", snd_strerror((int) written));
+                    return NULL;
+                }
+                continue;
+            }
+            done += written;
+        }
+    }
+
+    return NULL;
+}
+
+static bool openAlsa(PcmAudio *pcm, const char *device) {
+    snd_pcm_uframes_t buffer_size, period_size;
+    int err;
+
+    err = snd_pcm_open(&pcm->alsa, device, SND_PCM_STREAM_PLAYBACK, 0);
+    if (err < 0) goto exit_error;
+
+    // the buffer must drain within PCM_AUDIO_LATENCY for requests to keep
+    // their timing
+    err = snd_pcm_set_params(pcm->alsa, SND_PCM_FORMAT_S16, SND_PCM_ACCESS_RW_INTERLEAVED, 1,
+        PCM_AUDIO_RATE, 1, PCM_AUDIO_LATENCY * 2 / 3 / 1000);
+    if (err < 0) goto exit_close;
+    err = snd_pcm_get_params(pcm->alsa, &buffer_size, &period_size);
+    if (err < 0) goto exit_close;
+    pcm->period_frames = period_size > PCM_BLOCK ? PCM_BLOCK : (int) period_size;
+
+    err = pthread_create(&pcm->thread, NULL, alsaLoop, pcm);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start audio thread: %s\n", strerror(err));
+        snd_pcm_close(pcm->alsa);
+        return false;
+    }
+    pcm->threaded = true;
+
+    return true;
+
+exit_close:
+    snd_pcm_close(pcm->alsa);
+
+exit_error:
+    fprintf(stderr, "Failed to open ALSA device \"%s\": %s\n", device, snd_strerror(err));
+    return false;
+}
+
+static void closeAlsa(PcmAudio *pcm, Nanoseconds now) {
+    struct timespec tail_time;
+    Nanoseconds wait = PCM_AUDIO_LATENCY + PCM_AUDIO_RELEASE_MS * (NS_PER_SEC / 1000);
+
+    // let the last release reach the buffer before stopping the thread
+    tail_time.tv_sec = wait / NS_PER_SEC;
+    tail_time.tv_nsec = wait % NS_PER_SEC;
+    while (nanosleep(&tail_time, &tail_time) < 0 && errno == EINTR);
+
+    stopThread(pcm);
+    snd_pcm_drain(pcm->alsa);
+    snd_pcm_close(pcm->alsa);
+}
+
+#endif
+
+PcmAudio *PcmAudio_open(const char *output, const int *freqs, int count, Nanoseconds now,
+    bool virtual_clock) {
+    PcmAudio *result_pcm = NULL;
+    bool opened;
+    int c;
+
+    result_pcm = (PcmAudio *) aligned_alloc(64, sizeof(PcmAudio));
+    if (result_pcm == NULL) goto exit;
+    memset(result_pcm, 0, sizeof(PcmAudio));
+
+    if (!buildTables(result_pcm, freqs, count)) goto exit_free_tables;
+    result_pcm->attack_frames = PCM_AUDIO_RATE * PCM_AUDIO_ATTACK_MS / 1000;
+    result_pcm->release_frames = PCM_AUDIO_RATE * PCM_AUDIO_RELEASE_MS / 1000;
+    result_pcm->started_at = now;
+    result_pcm->fd = -1;
+    result_pcm->wakeup_fd = -1;
+
+    if (strncmp(output, "alsa", 4) == 0 && (output[4] == '\0' || output[4] == ':')) {
+#ifdef HAVE_ALSA
+        opened = openAlsa(result_pcm, output[4] == ':' ? output + 5 : "default");
+#else
+        fprintf(stderr, "Built without ALSA support, can't play to \"%s\"\n", output);
+        opened = false;
+#endif
+    } else {
+        opened = openFile(result_pcm, output);
+        if (opened && !virtual_clock && !startFileThread(result_pcm)) {
+            closeFile(result_pcm);
+            opened = false;
+        }
+    }
+    if (!opened) goto exit_free_tables;
+
+    goto exit;
+
+exit_free_tables:
+    for (c = 0; c < result_pcm->table_count; c++) {
+        free(result_pcm->tables[c]);
+    }
+    free(result_pcm);
+    result_pcm = NULL;
+
+exit:
+    return result_pcm;
+}
+
+void PcmAudio_start(PcmAudio *pcm, Choice choice, Nanoseconds at) {
+    if (pcm->threaded) {
+        push(pcm, at, choice);
+        return;
+    }
+    renderUntil(pcm, at);
+    apply(pcm, choice);
+}
+
+void PcmAudio_stop(PcmAudio *pcm, Nanoseconds at) {
+    if (pcm->threaded) {
+        push(pcm, at, STOP_COMMAND);
+        return;
+    }
+    renderUntil(pcm, at);
+    apply(pcm, STOP_COMMAND);
+}
+
+void PcmAudio_close(PcmAudio *pcm, Nanoseconds now) {
+    int c;
+
+    PcmAudio_stop(pcm, now);
+#ifdef HAVE_ALSA
+    if (pcm->alsa != NULL) {
+        closeAlsa(pcm, now);
+    } else
+#endif
+    {
+        // the thread has played every request once joined, the rest is ours
+        if (pcm->threaded) stopThread(pcm);
+        renderUntil(pcm, now + PCM_AUDIO_RELEASE_MS * (NS_PER_SEC / 1000));
+        closeFile(pcm);
+    }
+
+    for (c = 0; c < pcm->table_count; c++) {
+        free(pcm->tables[c]);
+    }
+    free(pcm);
+}
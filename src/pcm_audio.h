@@ -0,0 +1,46 @@
+#ifndef PCM_AUDIO_H
+#define PCM_AUDIO_H
+
+#include <stdbool.h>
+
+#include "platform.h"
+
+// Software tone generator for stations with a speaker instead of a PWM
+// buzzer. Each tone is a sine precomputed into a wavetable holding a whole
+// number of periods, so mixing is a straight multiply-add over contiguous
+// samples. Tones fade in and out over short linear envelopes to avoid
+// clicks, and start and stop at the sample matching the nanoTimestamp they
+// were requested at.
+//
+// output is one of
+//   alsa[:DEVICE]  play through ALSA, "default" if no device is given
+//   -              16-bit mono WAV stream on stdout
+//   PATH           16-bit mono WAV file, for a fifo too
+// File sinks place every request on the sample matching its timestamp. On a
+// virtual clock they render synchronously up to each request; on a real one
+// they render on a thread of their own, so neither a long stretch since the
+// last request nor a slow pipe reader can hold up the caller. Silence is
+// skipped over with a seek in a regular file. ALSA output renders on its own
+// thread and plays every request PCM_AUDIO_LATENCY after its timestamp, so
+// the delay is the same whatever the buffer fill.
+//
+// The mixing loops need -O3 (or -ftree-vectorize) to be vectorized.
+
+#define PCM_AUDIO_RATE 48000
+#define PCM_AUDIO_VOICES 4
+#define PCM_AUDIO_ATTACK_MS 5
+#define PCM_AUDIO_RELEASE_MS 20
+#define PCM_AUDIO_LATENCY (30 * (NS_PER_SEC / 1000))
+
+typedef struct PcmAudio PcmAudio;
+
+// one tone per choice, at freqs[choice] Hz; now is when the first sample
+// plays, and virtual_clock is set by backends whose nanoTimestamp jumps
+PcmAudio *PcmAudio_open(const char *output, const int *freqs, int count, Nanoseconds now,
+    bool virtual_clock);
+void PcmAudio_start(PcmAudio *pcm, Choice choice, Nanoseconds at);
+void PcmAudio_stop(PcmAudio *pcm, Nanoseconds at);
+// lets a tone still sounding at now fade out before closing
+void PcmAudio_close(PcmAudio *pcm, Nanoseconds now);
+
+#endif
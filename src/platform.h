@@ -1,32 +1,107 @@
 #ifndef PLATFORM_H
 #define PLATFORM_H
 
-#define NS_PER_SEC 1000000000
+#define NS_PER_SEC ((Nanoseconds) 1000000000)
+#define NO_DEADLINE -1
 
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <time.h>
 
 #include "game.h"
 
+#define NO_PWM_CHANNEL -1
+
 typedef struct LedsDevice LedsDevice;
 typedef struct InputDevice InputDevice;
 typedef struct SoundDevice SoundDevice;
+typedef struct EventLoop EventLoop;
+
+// The hardware one game station is wired to. Backends ignore the parts that
+// mean nothing to them.
+typedef struct {
+    // index of the station within the process, for backends that keep
+    // per-station state of their own
+    int id;
+    const char *gpio_chip;
+    // 2 to MAX_CHOICES; only the first choice_count entries of the tables
+    // below are used
+    int choice_count;
+    int led_pins[MAX_CHOICES];
+    int button_pins[MAX_CHOICES];
+    // Hz
+    int tone_freqs[MAX_CHOICES];
+    // channel on pwmchip0 driving the buzzer, or NO_PWM_CHANNEL
+    int pwm_channel;
+    // where software-rendered tones go, see PcmAudio_open; NULL for none,
+    // and on the Raspberry Pi for the PWM buzzer instead
+    const char *audio_output;
+} StationConfig;
+
+// fills in the backend's wiring for a single station, with
+// DEFAULT_CHOICE_COUNT choices and Choice_defaultFrequency tones for all of
+// MAX_CHOICES
+void defaultStationConfig(StationConfig *config_out);
 
-LedsDevice *initLedsDevice(void);
-void turnOnLed(LedsDevice *dev, Choice choice);
-void turnOffAllLeds(LedsDevice *dev);
+// what a backend with a screen shows next to a station's LEDs
+typedef struct {
+    State state;
+    uint64_t round;
+    // game loop passes per second, over the last second the loop ran
+    uint64_t loop_rate;
+} StationStatus;
+
+LedsDevice *initLedsDevice(const StationConfig *config);
+// bit n of mask lights the LED for Choice n, every other LED is turned off
+void setLeds(LedsDevice *dev, ChoiceMask mask);
+// ignored by backends with nowhere to show it
+void setStatus(LedsDevice *dev, const StationStatus *status);
+// Writes out what a backend held back to cap its frame rate, if it is due.
+// Returns when it next wants calling, or NO_DEADLINE with nothing pending.
+Nanoseconds flushLeds(LedsDevice *dev, Nanoseconds now);
 void deinitLedsDevice(LedsDevice *dev);
 
-InputDevice *initInputDevice(void);
+InputDevice *initInputDevice(const StationConfig *config);
 bool pollInput(InputDevice *dev, InputEvent *ev_out);
+// drop edges that happened before now; called when a station starts
+// listening for the player's answer
 void clearInputEvents(InputDevice *dev);
+// fd that becomes readable when pollInput may have an event to hand out
+int getInputFd(InputDevice *dev);
+// true once the device can never produce another event
+bool inputExhausted(InputDevice *dev);
 void deinitInputDevice(InputDevice *dev);
 
-SoundDevice *initSoundDevice(void);
+SoundDevice *initSoundDevice(const StationConfig *config);
 void startTone(SoundDevice *dev, Choice choice);
 void stopTone(SoundDevice *dev);
 void deinitSoundDevice(SoundDevice *dev);
 
-time_t nanoTimestamp(void);
+// One wait covering the input of every station in the process.
+EventLoop *initEventLoop(void);
+// ctx is handed back by waitForEvents when dev may have input
+bool watchInput(EventLoop *loop, InputDevice *dev, void *ctx);
+// ctx is handed back when fd is readable; for input gathered on another
+// thread, so it never counts as exhausted
+bool watchWakeupFd(EventLoop *loop, int fd, void *ctx);
+// Sleeps until a watched device may have input or the absolute nanoTimestamp
+// deadline (NO_DEADLINE to wait indefinitely) passes. The ctx of up to
+// max_ready devices that may have input is written to ready_out and their
+// count returned, or -1 on an unrecoverable error or once no watched device
+// can ever produce input again. wait_mask is the signal mask to apply while
+// asleep, as with ppoll().
+int waitForEvents(EventLoop *loop, Nanoseconds deadline, const sigset_t *wait_mask,
+    void **ready_out, int max_ready);
+void deinitEventLoop(EventLoop *loop);
+
+// Every backend keeps time on PLATFORM_CLOCK_ID: timers, kernel input event
+// timestamps and nanoTimestamp all share it so they can be subtracted. It is
+// CLOCK_MONOTONIC because that is what GPIO edge and evdev timestamps can be
+// stamped with; it never steps with NTP or date changes, and reading it goes
+// through the vDSO without a syscall.
+#define PLATFORM_CLOCK_ID CLOCK_MONOTONIC
+
+Nanoseconds nanoTimestamp(void);
 
 #endif
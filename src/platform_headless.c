@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "game.h"
+#include "pcm_audio.h"
+#include "platform.h"
+
+// Backend with no hardware at all, for soak and regression runs. Each
+// station gets a scripted player that watches which LED lights during
+// playback and answers once the station starts listening, making a mistake
+// once the sequence reaches HEADLESS_ROUNDS. Time is virtual: waiting jumps
+// the clock straight to the next timer deadline or player action, so games
+// run as fast as the state machine can go.
+
+#define DEFAULT_GAMES 1000000
+#define DEFAULT_ROUNDS 8
+#define DEFAULT_REACTION_MS 300
+#define DEFAULT_PRESS_MS 150
+// waits between looks for signals the loop has blocked
+#define SIGNAL_CHECK_INTERVAL 1024
+
+typedef struct {
+    InputEvent *queue;
+    int queue_len;
+    int queue_pos;
+    Choice *observed;
+    int observed_len;
+    int choice_count;
+    int fail_round;
+    long games_left;
+    Nanoseconds reaction_time;
+    Nanoseconds press_len;
+} Player;
+
+typedef struct LedsDevice {
+    Player *player;
+} LedsDevice;
+
+typedef struct InputDevice {
+    Player *player;
+} InputDevice;
+
+typedef struct SoundDevice {
+    // NULL for a silent station
+    PcmAudio *pcm;
+} SoundDevice;
+
+typedef struct {
+    InputDevice *dev;
+    void *ctx;
+} Watch;
+
+typedef struct EventLoop {
+    Watch watches[MAX_STATIONS];
+    int watch_count;
+    unsigned int waits;
+} EventLoop;
+
+static Player players[MAX_STATIONS];
+static Nanoseconds virtual_now = 0;
+
+static long envLong(const char *name, long default_value) {
+    const char *value = getenv(name);
+    char *end;
+    long result;
+
+    if (value == NULL || *value == '\0') return default_value;
+    result = strtol(value, &end, 10);
+    if (*end != '\0' || result <= 0) {
+        fprintf(stderr, "Ignoring invalid %s=\"%s\"\n", name, value);
+        return default_value;
+    }
+
+    return result;
+}
+
+static bool playerAnswering(Player *p) {
+    return p->queue_pos < p->queue_len;
+}
+
+// the script is done once the last game has been lost
+static bool playerDone(Player *p) {
+    return !playerAnswering(p) && p->games_left <= 0;
+}
+
+static void queueEvent(Player *p, EventType type, Choice choice, Nanoseconds at) {
+    InputEvent *ev = &p->queue[p->queue_len++];
+
+    ev->type = type;
+    ev->choice = choice;
+    ev->timestamp = at;
+}
+
+// replay what was shown during playback, fumbling the last element of the
+// round the player is scripted to lose on
+static void playerAnswer(Player *p) {
+    Nanoseconds at = virtual_now;
+    Choice choice;
+    int i;
+
+    p->queue_len = 0;
+    p->queue_pos = 0;
+
+    for (i = 0; i < p->observed_len; i++) {
+        choice = p->observed[i];
+        at += p->reaction_time;
+        if (p->observed_len >= p->fail_round && i == p->observed_len - 1) {
+            queueEvent(p, event_button_down, (choice + 1) % p->choice_count, at);
+            p->games_left--;
+            break;
+        }
+        queueEvent(p, event_button_down, choice, at);
+        at += p->press_len;
+        queueEvent(p, event_button_up, choice, at);
+    }
+
+    p->observed_len = 0;
+}
+
+void defaultStationConfig(StationConfig *config_out) {
+    int i;
+
+    config_out->id = 0;
+    config_out->gpio_chip = NULL;
+    config_out->choice_count = DEFAULT_CHOICE_COUNT;
+    for (i = 0; i < MAX_CHOICES; i++) {
+        config_out->led_pins[i] = i;
+        config_out->button_pins[i] = i;
+        config_out->tone_freqs[i] = Choice_defaultFrequency(i);
+    }
+    config_out->pwm_channel = NO_PWM_CHANNEL;
+    config_out->audio_output = NULL;
+}
+
+LedsDevice *initLedsDevice(const StationConfig *config) {
+    LedsDevice *result_dev = NULL;
+    Player *player = &players[config->id];
+    int fail_round;
+
+    result_dev = (LedsDevice *) malloc(sizeof(LedsDevice));
+    if (result_dev == NULL) goto exit;
+
+    fail_round = (int) envLong("HEADLESS_ROUNDS", DEFAULT_ROUNDS);
+    player->queue = (InputEvent *) malloc(2 * fail_round * sizeof(InputEvent));
+    player->observed = (Choice *) malloc(fail_round * sizeof(Choice));
+    if (player->queue == NULL || player->observed == NULL) {
+        free(player->queue);
+        free(player->observed);
+        free(result_dev);
+        result_dev = NULL;
+        goto exit;
+    }
+    player->queue_len = 0;
+    player->queue_pos = 0;
+    player->observed_len = 0;
+    player->choice_count = config->choice_count;
+    player->fail_round = fail_round;
+    player->games_left = envLong("HEADLESS_GAMES", DEFAULT_GAMES);
+    player->reaction_time = envLong("HEADLESS_REACTION_MS", DEFAULT_REACTION_MS) * (NS_PER_SEC / 1000);
+    player->press_len = DEFAULT_PRESS_MS * (NS_PER_SEC / 1000);
+
+    result_dev->player = player;
+
+exit:
+    return result_dev;
+}
+
+void setLeds(LedsDevice *dev, ChoiceMask mask) {
+    Player *p = dev->player;
+
+    // the player's own presses light the LEDs too
+    if (mask == 0 || playerAnswering(p)) return;
+    if (p->observed_len < p->fail_round) {
+        p->observed[p->observed_len++] = (Choice) __builtin_ctzll(mask);
+    }
+}
+
+void setStatus(LedsDevice *dev, const StationStatus *status) {}
+
+Nanoseconds flushLeds(LedsDevice *dev, Nanoseconds now) {
+    return NO_DEADLINE;
+}
+
+void deinitLedsDevice(LedsDevice *dev) {
+    free(dev->player->queue);
+    free(dev->player->observed);
+    free(dev);
+}
+
+InputDevice *initInputDevice(const StationConfig *config) {
+    InputDevice *result_dev = NULL;
+
+    result_dev = (InputDevice *) malloc(sizeof(InputDevice));
+    if (result_dev == NULL) goto exit;
+
+    result_dev->player = &players[config->id];
+
+exit:
+    return result_dev;
+}
+
+bool pollInput(InputDevice *dev, InputEvent *ev_out) {
+    Player *p = dev->player;
+
+    if (!playerAnswering(p)) return false;
+    if (p->queue[p->queue_pos].timestamp > virtual_now) return false;
+
+    *ev_out = p->queue[p->queue_pos++];
+
+    return true;
+}
+
+// the station is listening now: answer the round just shown
+void clearInputEvents(InputDevice *dev) {
+    Player *p = dev->player;
+
+    if (!playerAnswering(p) && p->games_left > 0) {
+        playerAnswer(p);
+    }
+}
+
+int getInputFd(InputDevice *dev) {
+    return -1;
+}
+
+bool inputExhausted(InputDevice *dev) {
+    return playerDone(dev->player);
+}
+
+void deinitInputDevice(InputDevice *dev) {
+    free(dev);
+}
+
+// on the virtual clock a WAV file holds exactly what a speaker would have
+// played, however fast the games ran
+SoundDevice *initSoundDevice(const StationConfig *config) {
+    SoundDevice *result_dev = NULL;
+
+    result_dev = (SoundDevice *) malloc(sizeof(SoundDevice));
+    if (result_dev == NULL) goto exit;
+
+    result_dev->pcm = NULL;
+    if (config->audio_output == NULL) goto exit;
+
+    result_dev->pcm = PcmAudio_open(config->audio_output, config->tone_freqs, config->choice_count,
+        virtual_now, true);
+    if (result_dev->pcm == NULL) {
+        free(result_dev);
+        result_dev = NULL;
+    }
+
+exit:
+    return result_dev;
+}
+
+void startTone(SoundDevice *dev, Choice choice) {
+    if (dev->pcm != NULL) PcmAudio_start(dev->pcm, choice, virtual_now);
+}
+
+void stopTone(SoundDevice *dev) {
+    if (dev->pcm != NULL) PcmAudio_stop(dev->pcm, virtual_now);
+}
+
+void deinitSoundDevice(SoundDevice *dev) {
+    if (dev->pcm != NULL) PcmAudio_close(dev->pcm, virtual_now);
+    free(dev);
+}
+
+EventLoop *initEventLoop(void) {
+    EventLoop *result_loop = NULL;
+
+    result_loop = (EventLoop *) malloc(sizeof(EventLoop));
+    if (result_loop == NULL) goto exit;
+
+    result_loop->watch_count = 0;
+    result_loop->waits = 0;
+
+exit:
+    return result_loop;
+}
+
+bool watchInput(EventLoop *loop, InputDevice *dev, void *ctx) {
+    if (loop->watch_count >= MAX_STATIONS) return false;
+
+    loop->watches[loop->watch_count].dev = dev;
+    loop->watches[loop->watch_count].ctx = ctx;
+    loop->watch_count++;
+
+    return true;
+}
+
+bool watchWakeupFd(EventLoop *loop, int fd, void *ctx) {
+    fprintf(stderr, "The headless backend has no file descriptors to wait on\n");
+
+    return false;
+}
+
+// Never sleeps, so signals only get in where the loop opens its mask: now
+// and then, briefly, if any are pending. Returns true if one was delivered.
+static bool deliverSignals(EventLoop *loop, const sigset_t *wait_mask) {
+    sigset_t pending, blocked;
+
+    if (wait_mask == NULL || ++loop->waits % SIGNAL_CHECK_INTERVAL != 0) return false;
+    if (sigpending(&pending) < 0 || sigisemptyset(&pending)) return false;
+
+    sigprocmask(SIG_SETMASK, wait_mask, &blocked);
+    sigprocmask(SIG_SETMASK, &blocked, NULL);
+
+    return true;
+}
+
+int waitForEvents(EventLoop *loop, Nanoseconds deadline, const sigset_t *wait_mask,
+    void **ready_out, int max_ready) {
+    Player *p;
+    Nanoseconds next_input_at;
+    bool all_done = true;
+    int count = 0;
+    int i;
+
+    // back to the loop without moving the clock, to look at what the
+    // handlers set
+    if (deliverSignals(loop, wait_mask)) return 0;
+
+    for (i = 0; i < loop->watch_count; i++) {
+        p = loop->watches[i].dev->player;
+        if (!playerDone(p)) all_done = false;
+        if (!playerAnswering(p)) continue;
+
+        next_input_at = p->queue[p->queue_pos].timestamp;
+        if (deadline == NO_DEADLINE || next_input_at < deadline) {
+            deadline = next_input_at;
+        }
+    }
+
+    // with no timer armed and no press coming, nothing will ever happen
+    if (all_done || deadline == NO_DEADLINE) return -1;
+
+    if (deadline > virtual_now) {
+        virtual_now = deadline;
+    }
+
+    for (i = 0; i < loop->watch_count && count < max_ready; i++) {
+        p = loop->watches[i].dev->player;
+        if (playerAnswering(p) && p->queue[p->queue_pos].timestamp <= virtual_now) {
+            ready_out[count++] = loop->watches[i].ctx;
+        }
+    }
+
+    return count;
+}
+
+void deinitEventLoop(EventLoop *loop) {
+    free(loop);
+}
+
+Nanoseconds nanoTimestamp(void) {
+    return virtual_now;
+}
@@ -1,15 +1,69 @@
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include "game.h"
+#include "pcm_audio.h"
 #include "platform.h"
+#ifdef PLATFORM_URING
+#include "uring.h"
+#endif
+
+// Choice n is the key at button_pins[n] in the row-by-row layout below,
+// which keeps a board of up to TTY_MAX_CHOICES on the keyboard
+#define TTY_KEYS "1234567890qwertyuiopasdfghjklzxcvbnm"
+#define TTY_MAX_CHOICES ((int) sizeof(TTY_KEYS) - 1)
+#define NO_KEY_CHOICE -1
+
+static const int key_codes[TTY_MAX_CHOICES] = {
+    KEY_1, KEY_2, KEY_3, KEY_4, KEY_5, KEY_6, KEY_7, KEY_8, KEY_9, KEY_0,
+    KEY_Q, KEY_W, KEY_E, KEY_R, KEY_T, KEY_Y, KEY_U, KEY_I, KEY_O, KEY_P,
+    KEY_A, KEY_S, KEY_D, KEY_F, KEY_G, KEY_H, KEY_J, KEY_K, KEY_L,
+    KEY_Z, KEY_X, KEY_C, KEY_V, KEY_B, KEY_N, KEY_M,
+};
 
+// at most this many frames a second reach the terminal
+#define FRAME_RATE 30
+// "[X] " per LED, then the status
+#define FRAME_LINE_LEN (4 * TTY_MAX_CHOICES + 64)
+// a line plus the escapes around it
+#define FRAME_LEN (FRAME_LINE_LEN + 32)
+
+// The board is a single terminal line. A frame rewrites only the part of the
+// line that changed, in one write() to a non-blocking stdout, and frames go
+// out at most FRAME_RATE times a second with the updates in between folded
+// into the next one. A terminal that stops reading holds frames back rather
+// than the game loop.
 typedef struct LedsDevice {
-    bool left_led_on;
-    bool mid_led_on;
-    bool right_led_on;
+    int choice_count;
+    ChoiceMask leds;
+    StationStatus status;
+    bool has_status;
+    // the line as of the last frame, shown_len -1 when it is unknown
+    char shown[FRAME_LINE_LEN];
+    int shown_len;
+    // changed since the last frame
+    bool dirty;
+    Nanoseconds last_frame_at;
+    // the part of the last frame the terminal hasn't taken yet
+    char out[FRAME_LEN];
+    int out_len;
+    int out_pos;
+    // stdout, reopened non-blocking unless it is a plain file
+    int out_fd;
 } LedsDevice;
 
 typedef enum {
@@ -18,117 +72,479 @@ typedef enum {
     INPUT_STATE_COUNT,
 } InputState;
 
+// must be a power of two
+#define EVDEV_QUEUE_LEN 64
+#define EVDEV_READ_BATCH 32
+#define EVDEV_SCAN_MAX 32
+
 typedef struct InputDevice {
     InputState state;
-    time_t time_when_pressed;
     Choice last_button_pressed;
+    // typed character and evdev key code to choice, NO_KEY_CHOICE for keys
+    // that aren't on the board
+    int8_t char_choices[256];
+    int8_t code_choices[KEY_MAX + 1];
+    struct termios saved_term_attr;
+    // stdin is a pipe or file that has been read to the end
+    bool stdin_closed;
+    // stdin's flags before it was made non-blocking, -1 if left alone
+    int saved_stdin_flags;
+    // stdin while idle, release_timer_fd while a press is held, or only
+    // evdev_fd when reading a real keyboard
+    int epoll_fd;
+    int release_timer_fd;
+    // -1 unless $GAME_EVDEV_DEVICE picked an evdev keyboard, which reports
+    // real press and release times for any number of keys at once
+    int evdev_fd;
+    InputEvent evdev_queue[EVDEV_QUEUE_LEN];
+    unsigned int evdev_queue_head;
+    unsigned int evdev_queue_tail;
 } InputDevice;
 
-typedef struct SoundDevice {} SoundDevice;
+typedef struct SoundDevice {
+    // NULL for a silent station
+    PcmAudio *pcm;
+} SoundDevice;
+
+static int formatLine(const LedsDevice *dev, char *line) {
+    int len = 0;
+    Choice i;
+
+    for (i = 0; i < dev->choice_count; i++) {
+        if (i > 0) line[len++] = ' ';
+        line[len++] = '[';
+        line[len++] = dev->leds & Choice_bit(i) ? 'X' : '-';
+        line[len++] = ']';
+    }
+    line[len] = '\0';
+    if (dev->has_status) {
+        len += snprintf(line + len, FRAME_LINE_LEN - len, "  %-19s round %-4llu %llu loops/s",
+            State_name(dev->status.state),
+            (unsigned long long) dev->status.round,
+            (unsigned long long) dev->status.loop_rate);
+    }
+
+    return len < FRAME_LINE_LEN ? len : FRAME_LINE_LEN - 1;
+}
+
+// false while the terminal still has some of the frame to take
+static bool writeOut(LedsDevice *dev) {
+    ssize_t written;
+
+    while (dev->out_pos < dev->out_len) {
+        written = write(dev->out_fd, dev->out + dev->out_pos, dev->out_len - dev->out_pos);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return false;
+            // the terminal is gone, nothing to redraw for
+            break;
+        }
+        dev->out_pos += written;
+    }
+    dev->out_pos = 0;
+    dev->out_len = 0;
+
+    return true;
+}
+
+// back to the start of the board line, then rewrite the columns that
+// differ and clear what is left of a longer old line
+static void renderFrame(LedsDevice *dev, Nanoseconds now) {
+    char line[FRAME_LINE_LEN];
+    int len, same = 0, end;
+
+    dev->dirty = false;
+    dev->last_frame_at = now;
+
+    len = formatLine(dev, line);
+    while (same < len && same < dev->shown_len && line[same] == dev->shown[same]) same++;
+    if (same == len && len == dev->shown_len) return;
+    end = len;
+    if (len == dev->shown_len) {
+        while (end > same && line[end - 1] == dev->shown[end - 1]) end--;
+    }
+
+    dev->out_len = snprintf(dev->out, FRAME_LEN, "\x1b[1F");
+    if (same > 0) {
+        dev->out_len += snprintf(dev->out + dev->out_len, FRAME_LEN - dev->out_len, "\x1b[%dC", same);
+    }
+    memcpy(dev->out + dev->out_len, line + same, end - same);
+    dev->out_len += end - same;
+    if (len < dev->shown_len || dev->shown_len < 0) {
+        dev->out_len += snprintf(dev->out + dev->out_len, FRAME_LEN - dev->out_len, "\x1b[K");
+    }
+    dev->out[dev->out_len++] = '\n';
+
+    memcpy(dev->shown, line, len);
+    dev->shown_len = len;
+    writeOut(dev);
+}
+
+void defaultStationConfig(StationConfig *config_out) {
+    int i;
+
+    config_out->id = 0;
+    config_out->gpio_chip = NULL;
+    config_out->choice_count = DEFAULT_CHOICE_COUNT;
+    for (i = 0; i < MAX_CHOICES; i++) {
+        config_out->led_pins[i] = i;
+        config_out->button_pins[i] = i;
+        config_out->tone_freqs[i] = Choice_defaultFrequency(i);
+    }
+    config_out->pwm_channel = NO_PWM_CHANNEL;
+    // silent unless audio= picks a sink; the ALSA one hasn't been run on
+    // real hardware yet
+    config_out->audio_output = NULL;
+}
+
+// Frames go out through an open file of their own: O_NONBLOCK on stdout's
+// would also hit stderr and the shell sharing it, and outlive a crash.
+static int openFrameFd(void) {
+    struct stat st;
+    int fd;
+
+    // a file never blocks, and reopened it would be written from the start
+    if (fstat(STDOUT_FILENO, &st) == 0 && S_ISREG(st.st_mode)) return STDOUT_FILENO;
+
+    fd = open("/proc/self/fd/1", O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to reopen stdout non-blocking: %s\n", strerror(errno));
+        return STDOUT_FILENO;
+    }
 
-static void redrawLeds(LedsDevice *dev) {
-    printf("\x1b[1F");
-    printf("\x1b[2K");
-    printf("[%c] [%c] [%c]\n",
-        dev->left_led_on ? 'X' : '-',
-        dev->mid_led_on ? 'X' : '-',
-        dev->right_led_on ? 'X' : '-');
+    return fd;
 }
 
-LedsDevice *initLedsDevice(void) {
+LedsDevice *initLedsDevice(const StationConfig *config) {
     LedsDevice *result_dev = NULL;
 
+    if (config->choice_count > TTY_MAX_CHOICES) {
+        fprintf(stderr, "The terminal backend has keys for at most %d choices\n", TTY_MAX_CHOICES);
+        goto exit;
+    }
+
     result_dev = (LedsDevice *) malloc(sizeof(LedsDevice));
     if (result_dev == NULL) goto exit;
 
-    result_dev->left_led_on = false;
-    result_dev->mid_led_on = false;
-    result_dev->right_led_on = false;
+    result_dev->choice_count = config->choice_count;
+    result_dev->leds = 0;
+    result_dev->has_status = false;
+    result_dev->shown_len = -1;
+    result_dev->dirty = false;
+    result_dev->last_frame_at = nanoTimestamp() - NS_PER_SEC / FRAME_RATE;
+    result_dev->out_len = 0;
+    result_dev->out_pos = 0;
+
+    result_dev->out_fd = openFrameFd();
 
 exit:
     return result_dev;
 }
 
-void turnOnLed(LedsDevice *dev, Choice choice) {
-    switch (choice) {
-    case choice_left:
-        dev->left_led_on = true;
-        break;
-    case choice_mid:
-        dev->mid_led_on = true;
-        break;
-    case choice_right:
-        dev->right_led_on = true;
-        break;
-    default:
-        break;
-    }
+Nanoseconds flushLeds(LedsDevice *dev, Nanoseconds now) {
+    const Nanoseconds frame_interval = NS_PER_SEC / FRAME_RATE;
 
-    redrawLeds(dev);
+    // the rest of the last frame goes first, checked on at the frame rate
+    if (!writeOut(dev)) return now + frame_interval;
+    if (!dev->dirty) return NO_DEADLINE;
+    if (now - dev->last_frame_at < frame_interval) return dev->last_frame_at + frame_interval;
+
+    renderFrame(dev, now);
+
+    return dev->out_len > 0 ? now + frame_interval : NO_DEADLINE;
 }
 
-void turnOffAllLeds(LedsDevice *dev) {
-    dev->left_led_on = false;
-    dev->mid_led_on = false;
-    dev->right_led_on = false;
+void setLeds(LedsDevice *dev, ChoiceMask mask) {
+    dev->leds = mask;
+    dev->dirty = true;
+    flushLeds(dev, nanoTimestamp());
+}
 
-    redrawLeds(dev);
+void setStatus(LedsDevice *dev, const StationStatus *status) {
+    dev->status = *status;
+    dev->has_status = true;
+    dev->dirty = true;
+    flushLeds(dev, nanoTimestamp());
 }
 
+// the last frame only goes out if the terminal takes it now, a stuck
+// terminal mustn't keep the process from exiting
 void deinitLedsDevice(LedsDevice *dev) {
+    if (writeOut(dev) && dev->dirty) renderFrame(dev, nanoTimestamp());
+    if (dev->out_fd != STDOUT_FILENO) close(dev->out_fd);
     free(dev);
 }
 
-InputDevice *initInputDevice(void) {
+static bool hasGameKeys(const InputDevice *dev, int fd) {
+    unsigned long key_bits[KEY_MAX / (8 * sizeof(unsigned long)) + 1] = { 0 };
+    const int bits_per_long = 8 * sizeof(unsigned long);
+    int code;
+
+    if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key_bits)), key_bits) < 0) return false;
+
+    for (code = 0; code <= KEY_MAX; code++) {
+        if (dev->code_choices[code] != NO_KEY_CHOICE &&
+            !(key_bits[code / bits_per_long] & (1UL << (code % bits_per_long)))) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static int openEvdevKeyboard(const InputDevice *dev, const char *path) {
+    int fd;
+
+    fd = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open evdev device \"%s\": %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (!hasGameKeys(dev, fd)) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+// $GAME_EVDEV_DEVICE names an event device (a uinput device works too), or
+// "auto" to take the first one with every key on the board
+static int openEvdevFromEnv(const InputDevice *dev) {
+    const char *path = getenv("GAME_EVDEV_DEVICE");
+    char scan_path[32];
+    clockid_t clock_id = PLATFORM_CLOCK_ID;
+    int fd = -1;
+    int i;
+
+    if (path == NULL || *path == '\0') return -1;
+
+    if (strcmp(path, "auto") == 0) {
+        for (i = 0; i < EVDEV_SCAN_MAX && fd < 0; i++) {
+            snprintf(scan_path, sizeof(scan_path), "/dev/input/event%d", i);
+            if (access(scan_path, R_OK) < 0) continue;
+            fd = openEvdevKeyboard(dev, scan_path);
+        }
+    } else {
+        fd = openEvdevKeyboard(dev, path);
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "No usable evdev keyboard, falling back to terminal input\n");
+        return -1;
+    }
+
+    // evdev stamps with CLOCK_REALTIME unless told otherwise
+    if (ioctl(fd, EVIOCSCLOCKID, &clock_id) < 0) {
+        fprintf(stderr, "Failed to set evdev clock: %s\n", strerror(errno));
+    }
+
+    return fd;
+}
+
+static bool watchOnly(InputDevice *dev, int fd, int unwatched_fd) {
+    struct epoll_event event = { 0 };
+
+    event.events = 0;
+    event.data.fd = unwatched_fd;
+    if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_MOD, unwatched_fd, &event) < 0) return false;
+
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if (epoll_ctl(dev->epoll_fd, EPOLL_CTL_MOD, fd, &event) < 0) return false;
+
+    return true;
+}
+
+InputDevice *initInputDevice(const StationConfig *config) {
     struct termios term_attr;
+    struct epoll_event event = { 0 };
     InputDevice *result_dev = NULL;
+    int key;
+    Choice i;
+
+    // there is only one keyboard
+    if (config->id != 0) {
+        fprintf(stderr, "The terminal backend only drives a single station\n");
+        goto exit;
+    }
+    for (i = 0; i < config->choice_count; i++) {
+        if (config->button_pins[i] < 0 || config->button_pins[i] >= TTY_MAX_CHOICES) {
+            fprintf(stderr, "No key %d for choice %d, keys are 0-%d of \"%s\"\n",
+                config->button_pins[i], i, TTY_MAX_CHOICES - 1, TTY_KEYS);
+            goto exit;
+        }
+    }
 
     result_dev = (InputDevice *) malloc(sizeof(InputDevice));
     if (result_dev == NULL) goto exit;
 
+    memset(result_dev->char_choices, NO_KEY_CHOICE, sizeof(result_dev->char_choices));
+    memset(result_dev->code_choices, NO_KEY_CHOICE, sizeof(result_dev->code_choices));
+    for (i = 0; i < config->choice_count; i++) {
+        key = config->button_pins[i];
+        result_dev->char_choices[(unsigned char) TTY_KEYS[key]] = (int8_t) i;
+        result_dev->code_choices[key_codes[key]] = (int8_t) i;
+    }
+
+    result_dev->release_timer_fd = timerfd_create(PLATFORM_CLOCK_ID, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (result_dev->release_timer_fd < 0) {
+        fprintf(stderr, "Failed to create key release timer: %s\n", strerror(errno));
+        goto exit_free_dev;
+    }
+
+    result_dev->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (result_dev->epoll_fd < 0) {
+        fprintf(stderr, "Failed to create input epoll instance: %s\n", strerror(errno));
+        goto exit_close_timer;
+    }
+
+    result_dev->evdev_fd = openEvdevFromEnv(result_dev);
+    result_dev->evdev_queue_head = 0;
+    result_dev->evdev_queue_tail = 0;
+
+    if (result_dev->evdev_fd >= 0) {
+        event.events = EPOLLIN;
+        event.data.fd = result_dev->evdev_fd;
+        if (epoll_ctl(result_dev->epoll_fd, EPOLL_CTL_ADD, result_dev->evdev_fd, &event) < 0) {
+            fprintf(stderr, "Failed to watch evdev keyboard: %s\n", strerror(errno));
+            goto exit_close_evdev_close_epoll;
+        }
+    } else {
+        event.events = EPOLLIN;
+        event.data.fd = STDIN_FILENO;
+        if (epoll_ctl(result_dev->epoll_fd, EPOLL_CTL_ADD, STDIN_FILENO, &event) < 0) {
+            fprintf(stderr, "Failed to watch stdin: %s\n", strerror(errno));
+            goto exit_close_evdev_close_epoll;
+        }
+        event.events = 0;
+        event.data.fd = result_dev->release_timer_fd;
+        if (epoll_ctl(result_dev->epoll_fd, EPOLL_CTL_ADD, result_dev->release_timer_fd, &event) < 0) {
+            fprintf(stderr, "Failed to watch key release timer: %s\n", strerror(errno));
+            goto exit_close_evdev_close_epoll;
+        }
+    }
+
     tcgetattr(STDIN_FILENO, &term_attr);
+    result_dev->saved_term_attr = term_attr;
     term_attr.c_cc[VMIN] = 0;
     term_attr.c_cc[VTIME] = 0;
     term_attr.c_lflag &= ~(ICANON | ECHO);
     tcsetattr(STDIN_FILENO, TCSANOW, &term_attr);
 
+    // a pipe would block the drain after each key until the next one
+    // arrives, stalling every timer meanwhile
+    result_dev->saved_stdin_flags = -1;
+    if (result_dev->evdev_fd < 0 && !isatty(STDIN_FILENO)) {
+        result_dev->saved_stdin_flags = fcntl(STDIN_FILENO, F_GETFL);
+        if (result_dev->saved_stdin_flags < 0 ||
+            fcntl(STDIN_FILENO, F_SETFL, result_dev->saved_stdin_flags | O_NONBLOCK) < 0) {
+            fprintf(stderr, "Failed to make stdin non-blocking: %s\n", strerror(errno));
+            result_dev->saved_stdin_flags = -1;
+        }
+    }
+
     result_dev->state = input_state_idle;
-    result_dev->time_when_pressed = 0;
+    result_dev->stdin_closed = false;
+
+    goto exit;
+
+exit_close_evdev_close_epoll:
+    if (result_dev->evdev_fd >= 0) close(result_dev->evdev_fd);
+    close(result_dev->epoll_fd);
+
+exit_close_timer:
+    close(result_dev->release_timer_fd);
+
+exit_free_dev:
+    free(result_dev);
+    result_dev = NULL;
 
 exit:
     return result_dev;
 }
 
+static bool convertEvdevEvent(const InputDevice *dev, const struct input_event *event, InputEvent *ev_out) {
+    if (event->type != EV_KEY || event->code > KEY_MAX) return false;
+
+    ev_out->choice = dev->code_choices[event->code];
+    if (ev_out->choice == NO_KEY_CHOICE) return false;
+    switch (event->value) {
+    case 1:
+        ev_out->type = event_button_down;
+        break;
+    case 0:
+        ev_out->type = event_button_up;
+        break;
+    default:
+        // autorepeat
+        return false;
+    }
+    ev_out->timestamp = (Nanoseconds) event->input_event_sec * NS_PER_SEC +
+        (Nanoseconds) event->input_event_usec * 1000;
+
+    return true;
+}
+
+static bool pollEvdev(InputDevice *dev, InputEvent *ev_out) {
+    struct input_event events[EVDEV_READ_BATCH];
+    unsigned int space;
+    size_t count;
+    ssize_t ret;
+    size_t i;
+
+    if (dev->evdev_queue_head == dev->evdev_queue_tail) {
+        space = EVDEV_QUEUE_LEN - (dev->evdev_queue_tail - dev->evdev_queue_head);
+        count = space < EVDEV_READ_BATCH ? space : EVDEV_READ_BATCH;
+        ret = read(dev->evdev_fd, events, count * sizeof(events[0]));
+        if (ret <= 0) return false;
+
+        for (i = 0; i < (size_t) ret / sizeof(events[0]); i++) {
+            if (convertEvdevEvent(dev, &events[i], &dev->evdev_queue[dev->evdev_queue_tail % EVDEV_QUEUE_LEN])) {
+                dev->evdev_queue_tail++;
+            }
+        }
+        if (dev->evdev_queue_head == dev->evdev_queue_tail) return false;
+    }
+
+    *ev_out = dev->evdev_queue[dev->evdev_queue_head % EVDEV_QUEUE_LEN];
+    dev->evdev_queue_head++;
+
+    return true;
+}
+
 bool pollInput(InputDevice *dev, InputEvent *ev_out) {
-    const time_t simulated_press_len = NS_PER_SEC / 5;
-    time_t elapsed = 0;
+    const Nanoseconds simulated_press_len = NS_PER_SEC / 5;
+    struct itimerspec release_time = { 0 };
+    uint64_t expirations;
     ssize_t nread = 0;
     char buf[1] = { 0 };
     bool received_input = false;
     Choice choice;
 
+    if (dev->evdev_fd >= 0) return pollEvdev(dev, ev_out);
+
     switch (dev->state) {
     case input_state_idle:
+        if (dev->stdin_closed) break;
+        // nothing to read is -1 with EAGAIN from a pipe, no event either way
         nread = read(STDIN_FILENO, buf, 1);
+        if (nread == 0 && !isatty(STDIN_FILENO)) {
+            // a terminal with VMIN=0 also reads 0 bytes when empty, but
+            // anything else is at EOF and would otherwise poll readable forever
+            epoll_ctl(dev->epoll_fd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+            dev->stdin_closed = true;
+        }
         if (nread > 0) {
-            switch (buf[0]) {
-            case '1':
-                choice = choice_left;
-                break;
-            case '2':
-                choice = choice_mid;
-                break;
-            case '3':
-                choice = choice_right;
-                break;
-            default:
-                choice = -1;
-                break;
-            }
-            if (choice >= 0) {
+            choice = dev->char_choices[(unsigned char) buf[0]];
+            if (choice != NO_KEY_CHOICE) {
                 ev_out->type = event_button_down;
                 ev_out->choice = choice;
-                dev->time_when_pressed = nanoTimestamp();
+                ev_out->timestamp = nanoTimestamp();
+                release_time.it_value.tv_sec = simulated_press_len / NS_PER_SEC;
+                release_time.it_value.tv_nsec = simulated_press_len % NS_PER_SEC;
+                timerfd_settime(dev->release_timer_fd, 0, &release_time, NULL);
+                watchOnly(dev, dev->release_timer_fd, STDIN_FILENO);
                 dev->last_button_pressed = choice;
                 dev->state = input_state_held;
                 received_input = true;
@@ -136,10 +552,12 @@ bool pollInput(InputDevice *dev, InputEvent *ev_out) {
         }
         break;
     case input_state_held:
-        elapsed = nanoTimestamp() - dev->time_when_pressed;
-        if (elapsed >= simulated_press_len) {
+        nread = read(dev->release_timer_fd, &expirations, sizeof(expirations));
+        if (nread == sizeof(expirations)) {
             ev_out->type = event_button_up;
             ev_out->choice = dev->last_button_pressed;
+            ev_out->timestamp = nanoTimestamp();
+            if (!dev->stdin_closed) watchOnly(dev, STDIN_FILENO, dev->release_timer_fd);
             received_input = true;
             dev->state = input_state_idle;
         }
@@ -152,32 +570,82 @@ bool pollInput(InputDevice *dev, InputEvent *ev_out) {
 }
 
 void clearInputEvents(InputDevice *dev) {
+    struct input_event events[EVDEV_READ_BATCH];
+
+    if (dev->evdev_fd >= 0) {
+        while (read(dev->evdev_fd, events, sizeof(events)) > 0);
+        dev->evdev_queue_head = 0;
+        dev->evdev_queue_tail = 0;
+    }
     tcflush(STDIN_FILENO, TCIFLUSH);
 }
 
+int getInputFd(InputDevice *dev) {
+    return dev->epoll_fd;
+}
+
+#ifdef PLATFORM_URING
+// stdin, the release timer and evdev all sit behind epoll_fd, which the
+// io_uring loop polls like any other fd
+UringOp *uringInputOp(InputDevice *dev) {
+    return NULL;
+}
+#endif
+
+bool inputExhausted(InputDevice *dev) {
+    return dev->evdev_fd < 0 && dev->stdin_closed && dev->state == input_state_idle;
+}
+
 void deinitInputDevice(InputDevice *dev) {
+    // keys typed while reading evdev also queued up on the terminal, don't
+    // hand them to the shell
+    if (dev->evdev_fd >= 0) {
+        tcflush(STDIN_FILENO, TCIFLUSH);
+        close(dev->evdev_fd);
+    }
+    tcsetattr(STDIN_FILENO, TCSANOW, &dev->saved_term_attr);
+    if (dev->saved_stdin_flags >= 0) fcntl(STDIN_FILENO, F_SETFL, dev->saved_stdin_flags);
+    close(dev->epoll_fd);
+    close(dev->release_timer_fd);
     free(dev);
 }
 
-SoundDevice *initSoundDevice(void) {
-    return (SoundDevice *) malloc(sizeof(SoundDevice));
+SoundDevice *initSoundDevice(const StationConfig *config) {
+    SoundDevice *result_dev = NULL;
+
+    result_dev = (SoundDevice *) malloc(sizeof(SoundDevice));
+    if (result_dev == NULL) goto exit;
+
+    result_dev->pcm = NULL;
+    if (config->audio_output == NULL) goto exit;
+
+    result_dev->pcm = PcmAudio_open(config->audio_output, config->tone_freqs, config->choice_count,
+        nanoTimestamp(), false);
+    if (result_dev->pcm == NULL) {
+        free(result_dev);
+        result_dev = NULL;
+    }
+
+exit:
+    return result_dev;
 }
 
 void startTone(SoundDevice *dev, Choice choice) {
-    // const int freq = freqs[choice];
-    // const int period_ns = NS_PER_SEC / freq;
-    // const int duty_cycle_ns = period_ns / 2;
+    if (dev->pcm != NULL) PcmAudio_start(dev->pcm, choice, nanoTimestamp());
 }
 
-void stopTone(SoundDevice *dev) {}
+void stopTone(SoundDevice *dev) {
+    if (dev->pcm != NULL) PcmAudio_stop(dev->pcm, nanoTimestamp());
+}
 
 void deinitSoundDevice(SoundDevice *dev) {
+    if (dev->pcm != NULL) PcmAudio_close(dev->pcm, nanoTimestamp());
     free(dev);
 }
 
-time_t nanoTimestamp(void) {
+Nanoseconds nanoTimestamp(void) {
     struct timespec ts;
-    clock_gettime(CLOCK_BOOTTIME, &ts);
+    clock_gettime(PLATFORM_CLOCK_ID, &ts);
 
-    return (ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
+    return ((Nanoseconds) ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
 }
@@ -1,7 +1,8 @@
+#define _GNU_SOURCE
+
 #include <linux/gpio.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <poll.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
@@ -11,7 +12,11 @@
 #include <time.h>
 
 #include "game.h"
+#include "pcm_audio.h"
 #include "platform.h"
+#ifdef PLATFORM_URING
+#include "uring.h"
+#endif
 
 #define GPIO_CHARDEV_PATH "/dev/gpiochip0"
 #define PWM_DEV_PATH "/sys/class/pwm/pwmchip0"
@@ -23,82 +28,197 @@
 #define BUTTON_PIN_MID 19
 #define BUTTON_PIN_RIGHT 26
 #define BUZZER_PIN 12
+#define BUZZER_PWM_CHANNEL 0
 
 #define DEBOUNCE_PERIOD_US 10000
 
+// button lookup by line offset, kept at most half full
+#define BUTTON_SLOT_BITS 7
+#define BUTTON_SLOTS (1 << BUTTON_SLOT_BITS)
+#define NO_BUTTON -1
+
 typedef struct LedsDevice {
     int fd;
+    // every line of the request, so a set touches the whole board
+    ChoiceMask lines;
 } LedsDevice;
 
+// must be a power of two
+#define INPUT_QUEUE_LEN 64
+#define INPUT_READ_BATCH 16
+
 typedef struct InputDevice {
+#ifdef PLATFORM_URING
+    // the read kept armed on fd, first so its completion leads back here
+    UringOp read_op;
+    int slot;
+    int reads_in_flight;
+    bool failed;
+    // edges stamped before this are dropped as the armed read returns them
+    Nanoseconds clear_before;
+    struct gpio_v2_line_event read_buf[INPUT_READ_BATCH];
+#endif
     int fd;
+    int button_pins[MAX_CHOICES];
+    // open addressing from line offset to choice, NO_BUTTON where empty, so
+    // converting an edge costs the same whatever the button count
+    int8_t button_slots[BUTTON_SLOTS];
+    // edges already read from fd but not yet handed out by pollInput
+    InputEvent queue[INPUT_QUEUE_LEN];
+    unsigned int queue_head;
+    unsigned int queue_tail;
 } InputDevice;
 
-typedef struct SoundDevice {
+typedef struct {
+    int period_ns;
+    int duty_cycle_ns;
+    char period[16];
+    char duty_cycle[16];
+    int period_len;
+    int duty_cycle_len;
+} ToneAttrs;
+
+typedef struct {
+#ifdef PLATFORM_URING
+    // first, so a write completion leads back here
+    UringOp write_op;
+    SoundDevice *dev;
+    int slot;
+#endif
     int fd;
+    const char *name;
+} PwmAttr;
+
+typedef struct SoundDevice {
+    // set when the station has a speaker instead, and then used alone
+    PcmAudio *pcm;
+    // NO_PWM_CHANNEL for a silent station, with no fds open
+    int pwm_channel;
+    PwmAttr period;
+    PwmAttr duty_cycle;
+    PwmAttr enable;
+    ToneAttrs tones[MAX_CHOICES];
+    // what the pwm0 attributes currently hold, so repeated writes can be skipped
+    int cur_period_ns;
+    int cur_duty_cycle_ns;
+    bool enabled;
+    // what startTone/stopTone last asked for
+    Choice want_tone;
+    bool want_enabled;
+#ifdef PLATFORM_URING
+    // Only one update is in flight at a time, its writes linked so they run
+    // in order; the next one is worked out from want_ once it completes.
+    int writes_in_flight;
+    struct io_uring_sqe *chain_tail;
+#endif
 } SoundDevice;
 
-static const int freqs[NUM_CHOICES] = { 440, 550, 660 };
+void defaultStationConfig(StationConfig *config_out) {
+    int i;
+
+    config_out->id = 0;
+    config_out->gpio_chip = GPIO_CHARDEV_PATH;
+    config_out->choice_count = DEFAULT_CHOICE_COUNT;
+    // only the classic three buttons have default wiring, larger boards
+    // give their pins in the station config
+    for (i = 0; i < MAX_CHOICES; i++) {
+        config_out->led_pins[i] = -1;
+        config_out->button_pins[i] = -1;
+        config_out->tone_freqs[i] = Choice_defaultFrequency(i);
+    }
+    config_out->led_pins[0] = LED_PIN_LEFT;
+    config_out->led_pins[1] = LED_PIN_MID;
+    config_out->led_pins[2] = LED_PIN_RIGHT;
+    config_out->button_pins[0] = BUTTON_PIN_LEFT;
+    config_out->button_pins[1] = BUTTON_PIN_MID;
+    config_out->button_pins[2] = BUTTON_PIN_RIGHT;
+    config_out->pwm_channel = BUZZER_PWM_CHANNEL;
+    config_out->audio_output = NULL;
+}
 
-LedsDevice *initLedsDevice(void) {
-    LedsDevice *result_dev = NULL;
+// returns the line request fd, or -1
+static int requestLines(const char *gpio_chip, struct gpio_v2_line_request *request) {
     int gpio_chardev_fd;
-    struct gpio_v2_line_request request = { 0 };
+    int result_fd = -1;
 
-    result_dev = (LedsDevice *) malloc(sizeof(LedsDevice));
-    if (result_dev == NULL) goto exit;
-    
-    gpio_chardev_fd = open(GPIO_CHARDEV_PATH, O_RDONLY);
+    gpio_chardev_fd = open(gpio_chip, O_RDONLY | O_CLOEXEC);
     if (gpio_chardev_fd < 0) {
-        fprintf(stderr, "Failed to open gpio device \"%s\": %s\n", GPIO_CHARDEV_PATH, strerror(errno));
-        result_dev = NULL;
+        fprintf(stderr, "Failed to open gpio device \"%s\": %s\n", gpio_chip, strerror(errno));
         goto exit;
     }
-    
-    strncpy(request.consumer, "leds", GPIO_MAX_NAME_SIZE);
-    request.offsets[0] = LED_PIN_LEFT;
-    request.offsets[1] = LED_PIN_MID;
-    request.offsets[2] = LED_PIN_RIGHT;
-    request.num_lines = 3;
-    request.config.flags = GPIO_V2_LINE_FLAG_ACTIVE_LOW | GPIO_V2_LINE_FLAG_OUTPUT;
 
-    if (ioctl(gpio_chardev_fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
-        fprintf(stderr, "Failed to get gpio line handle with GPIO_V2_GET_LINE_IOCTL: %s", strerror(errno));
-        result_dev = NULL;
+    if (ioctl(gpio_chardev_fd, GPIO_V2_GET_LINE_IOCTL, request) < 0) {
+        fprintf(stderr, "Failed to get gpio line handle with GPIO_V2_GET_LINE_IOCTL: %s\n", strerror(errno));
         goto exit_close_gpio_chardev;
     }
-    
-    result_dev->fd = request.fd;
+    result_fd = request->fd;
 
 exit_close_gpio_chardev:
     if (close(gpio_chardev_fd) < 0) {
-        fprintf(stderr, "Failed to close gpio device \"%s\": %s\n", GPIO_CHARDEV_PATH, strerror(errno));
+        fprintf(stderr, "Failed to close gpio device \"%s\": %s\n", gpio_chip, strerror(errno));
     }
 
 exit:
-    return result_dev;
+    return result_fd;
 }
 
-void turnOnLed(LedsDevice *dev, Choice choice) {
-    struct gpio_v2_line_values values = { 0 };
-    values.bits = -1;
-    values.mask = 1 << choice;
+static bool checkPins(const int *pins, int count, const char *what) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (pins[i] < 0) {
+            fprintf(stderr, "Failed to request gpio %s: no pin given for choice %d\n", what, i);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+LedsDevice *initLedsDevice(const StationConfig *config) {
+    LedsDevice *result_dev = NULL;
+    struct gpio_v2_line_request request = { 0 };
+    int i;
+
+    if (!checkPins(config->led_pins, config->choice_count, "LEDs")) goto exit;
+
+    result_dev = (LedsDevice *) malloc(sizeof(LedsDevice));
+    if (result_dev == NULL) goto exit;
     
-    if (ioctl(dev->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
-        fprintf(stderr, "Failed to set led line value to 1: %s\n", strerror(errno));
+    snprintf(request.consumer, GPIO_MAX_NAME_SIZE, "leds%d", config->id);
+    for (i = 0; i < config->choice_count; i++) {
+        request.offsets[i] = config->led_pins[i];
     }
+    request.num_lines = config->choice_count;
+    result_dev->lines = ChoiceMask_all(config->choice_count);
+    request.config.flags = GPIO_V2_LINE_FLAG_ACTIVE_LOW | GPIO_V2_LINE_FLAG_OUTPUT;
+
+    result_dev->fd = requestLines(config->gpio_chip, &request);
+    if (result_dev->fd < 0) {
+        free(result_dev);
+        result_dev = NULL;
+    }
+
+exit:
+    return result_dev;
 }
 
-void turnOffAllLeds(LedsDevice *dev) {
+void setLeds(LedsDevice *dev, ChoiceMask mask) {
     struct gpio_v2_line_values values = { 0 };
-    values.bits = 0;
-    values.mask = 0b111;
+    values.bits = mask;
+    values.mask = dev->lines;
     
     if (ioctl(dev->fd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values) < 0) {
-        fprintf(stderr, "Failed to set led line values to 0: %s\n", strerror(errno));
+        fprintf(stderr, "Failed to set led line values: %s\n", strerror(errno));
     }
 }
 
+void setStatus(LedsDevice *dev, const StationStatus *status) {}
+
+Nanoseconds flushLeds(LedsDevice *dev, Nanoseconds now) {
+    return NO_DEADLINE;
+}
+
 void deinitLedsDevice(LedsDevice *dev) {
     int ret;
 
@@ -110,161 +230,550 @@ void deinitLedsDevice(LedsDevice *dev) {
     free(dev);
 }
 
-InputDevice *initInputDevice(void) {
+static unsigned int buttonSlot(uint32_t offset) {
+    // Fibonacci hashing spreads runs of neighbouring offsets
+    return (offset * 2654435769u) >> (32 - BUTTON_SLOT_BITS);
+}
+
+static void addButton(InputDevice *dev, Choice choice) {
+    unsigned int slot = buttonSlot((uint32_t) dev->button_pins[choice]);
+
+    while (dev->button_slots[slot] != NO_BUTTON) {
+        slot = (slot + 1) % BUTTON_SLOTS;
+    }
+    dev->button_slots[slot] = (int8_t) choice;
+}
+
+static Choice findButton(const InputDevice *dev, uint32_t offset) {
+    unsigned int slot = buttonSlot(offset);
+    int choice;
+
+    while ((choice = dev->button_slots[slot]) != NO_BUTTON) {
+        if (dev->button_pins[choice] == (int) offset) return choice;
+        slot = (slot + 1) % BUTTON_SLOTS;
+    }
+
+    return NO_BUTTON;
+}
+
+static bool convertEvent(const InputDevice *dev, const struct gpio_v2_line_event *event, InputEvent *ev_out) {
+    ev_out->choice = findButton(dev, event->offset);
+    if (ev_out->choice == NO_BUTTON) return false;
+
+    switch (event->id) {
+    case GPIO_V2_LINE_EVENT_FALLING_EDGE:
+        ev_out->type = event_button_down;
+        break;
+    case GPIO_V2_LINE_EVENT_RISING_EDGE:
+        ev_out->type = event_button_up;
+        break;
+    default:
+        return false;
+    }
+    // without GPIO_V2_LINE_FLAG_EVENT_CLOCK_* flags the kernel stamps edges
+    // with CLOCK_MONOTONIC, the same clock as PLATFORM_CLOCK_ID
+    ev_out->timestamp = event->timestamp_ns;
+
+    return true;
+}
+
+#ifdef PLATFORM_URING
+
+static void armRead(InputDevice *dev) {
+    struct io_uring_sqe *sqe;
+
+    sqe = Uring_prep(&dev->read_op, IORING_OP_READ, dev->slot >= 0 ? dev->slot : dev->fd);
+    if (sqe == NULL) {
+        fprintf(stderr, "Failed to queue gpio buttons read: io_uring is full\n");
+        dev->failed = true;
+        return;
+    }
+    if (dev->slot >= 0) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t) dev->read_buf;
+    sqe->len = sizeof(dev->read_buf);
+    sqe->off = (uint64_t) -1;
+    dev->reads_in_flight = 1;
+}
+
+static bool readDone(UringOp *op, int32_t result, uint32_t flags) {
+    InputDevice *dev = (InputDevice *) op;
+    const struct gpio_v2_line_event *event;
+    bool queued = false;
+    size_t i;
+
+    dev->reads_in_flight = 0;
+    if (result <= 0) {
+        if (result != -ECANCELED) {
+            fprintf(stderr, "Failed to read gpio buttons: %s\n", result < 0 ? strerror(-result) : "end of file");
+            dev->failed = true;
+        }
+        return false;
+    }
+
+    for (i = 0; i < (size_t) result / sizeof(dev->read_buf[0]); i++) {
+        event = &dev->read_buf[i];
+        if ((Nanoseconds) event->timestamp_ns < dev->clear_before) continue;
+        if (dev->queue_tail - dev->queue_head == INPUT_QUEUE_LEN) break;
+        if (convertEvent(dev, event, &dev->queue[dev->queue_tail % INPUT_QUEUE_LEN])) {
+            dev->queue_tail++;
+            queued = true;
+        }
+    }
+    armRead(dev);
+
+    return queued;
+}
+
+UringOp *uringInputOp(InputDevice *dev) {
+    return &dev->read_op;
+}
+
+#endif
+
+InputDevice *initInputDevice(const StationConfig *config) {
     InputDevice *result_dev = NULL;
-    int gpio_chardev_fd;
     struct gpio_v2_line_request request = { 0 };
+    int i;
+
+    if (!checkPins(config->button_pins, config->choice_count, "buttons")) goto exit;
 
     result_dev = (InputDevice *) malloc(sizeof(InputDevice));
     if (result_dev == NULL) goto exit;
-    
-    gpio_chardev_fd = open(GPIO_CHARDEV_PATH, O_RDONLY);
-    if (gpio_chardev_fd < 0) {
-        fprintf(stderr, "Failed to open gpio device \"%s\": %s\n", GPIO_CHARDEV_PATH, strerror(errno));
-        result_dev = NULL;
-        goto exit;
-    }
 
-    strncpy(request.consumer, "buttons", GPIO_MAX_NAME_SIZE);
-    request.offsets[0] = BUTTON_PIN_LEFT;
-    request.offsets[1] = BUTTON_PIN_MID;
-    request.offsets[2] = BUTTON_PIN_RIGHT;
-    request.num_lines = 3;
+    snprintf(request.consumer, GPIO_MAX_NAME_SIZE, "buttons%d", config->id);
+    memset(result_dev->button_slots, NO_BUTTON, sizeof(result_dev->button_slots));
+    for (i = 0; i < config->choice_count; i++) {
+        request.offsets[i] = config->button_pins[i];
+        result_dev->button_pins[i] = config->button_pins[i];
+        addButton(result_dev, i);
+    }
+    request.num_lines = config->choice_count;
     request.config.flags =
         GPIO_V2_LINE_FLAG_INPUT |
         GPIO_V2_LINE_FLAG_EDGE_FALLING |
         GPIO_V2_LINE_FLAG_EDGE_RISING |
         GPIO_V2_LINE_FLAG_BIAS_PULL_UP;
-    request.config.attrs[0].mask = 0b111;
+    request.config.attrs[0].mask = ChoiceMask_all(config->choice_count);
     request.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_DEBOUNCE;
     request.config.attrs[0].attr.debounce_period_us = DEBOUNCE_PERIOD_US;
     request.config.num_attrs = 1;
 
-    if (ioctl(gpio_chardev_fd, GPIO_V2_GET_LINE_IOCTL, &request) < 0) {
-        fprintf(stderr, "Failed to get gpio line handle with GPIO_V2_GET_LINE_IOCTL: %s", strerror(errno));
+    result_dev->fd = requestLines(config->gpio_chip, &request);
+    if (result_dev->fd < 0) {
+        free(result_dev);
         result_dev = NULL;
-        goto exit_close_gpio_chardev;
+        goto exit;
     }
-    
-    result_dev->fd = request.fd;
-
-exit_close_gpio_chardev:
-    if (close(gpio_chardev_fd) < 0) {
-        fprintf(stderr, "Failed to close gpio device \"%s\": %s\n", GPIO_CHARDEV_PATH, strerror(errno));
+    result_dev->queue_head = 0;
+    result_dev->queue_tail = 0;
+
+#ifdef PLATFORM_URING
+    // the fd stays blocking so the kernel parks the read until an edge comes
+    if (!Uring_init()) {
+        close(result_dev->fd);
+        free(result_dev);
+        result_dev = NULL;
+        goto exit;
+    }
+    result_dev->slot = Uring_registerFile(result_dev->fd);
+    result_dev->read_op.complete = readDone;
+    result_dev->read_op.ctx = NULL;
+    result_dev->failed = false;
+    result_dev->clear_before = 0;
+    armRead(result_dev);
+#else
+    // pollInput reads until the fd is empty rather than polling first
+    if (fcntl(result_dev->fd, F_SETFL, fcntl(result_dev->fd, F_GETFL) | O_NONBLOCK) < 0) {
+        fprintf(stderr, "Failed to make gpio buttons line non-blocking: %s\n", strerror(errno));
     }
+#endif
 
 exit:
     return result_dev;
 }
 
-bool pollInput(InputDevice *dev, InputEvent *ev_out) {
-    struct pollfd poll_fd = { 0 };
-    struct gpio_v2_line_event event;
-    int ret;
+#ifndef PLATFORM_URING
 
-    poll_fd.fd = dev->fd;
-    poll_fd.events = POLLIN;
+// drain as many pending edges as fit in the queue with a single read
+static void fillQueue(InputDevice *dev) {
+    struct gpio_v2_line_event events[INPUT_READ_BATCH];
+    unsigned int space = INPUT_QUEUE_LEN - (dev->queue_tail - dev->queue_head);
+    size_t count;
+    ssize_t ret;
+    size_t i;
 
-    ret = poll(&poll_fd, 1, 0);
-    if (ret < 1) return false;
+    count = space < INPUT_READ_BATCH ? space : INPUT_READ_BATCH;
+    if (count == 0) return;
 
-    ret = read(dev->fd, &event, sizeof(event));
-    if (ret == -1) return false;
-    if (ret != sizeof(event)) return false;
-    switch (event.offset) {
-    case BUTTON_PIN_LEFT:
-        ev_out->choice = choice_left;
-        break;
-    case BUTTON_PIN_MID:
-        ev_out->choice = choice_mid;
-        break;
-    case BUTTON_PIN_RIGHT:
-        ev_out->choice = choice_right;
-        break;
-    default:
-        return false;
-        break;
+    ret = read(dev->fd, events, count * sizeof(events[0]));
+    if (ret <= 0) return;
+
+    for (i = 0; i < (size_t) ret / sizeof(events[0]); i++) {
+        if (convertEvent(dev, &events[i], &dev->queue[dev->queue_tail % INPUT_QUEUE_LEN])) {
+            dev->queue_tail++;
+        }
     }
-    switch (event.id) {
-    case GPIO_V2_LINE_EVENT_FALLING_EDGE:
-        ev_out->type = event_button_down;
-        break;
-    case GPIO_V2_LINE_EVENT_RISING_EDGE:
-        ev_out->type = event_button_up;
-        break;
+}
+
+#endif
+
+bool pollInput(InputDevice *dev, InputEvent *ev_out) {
+    if (dev->queue_head == dev->queue_tail) {
+#ifdef PLATFORM_URING
+        // readDone fills the queue
+        return false;
+#else
+        fillQueue(dev);
+        if (dev->queue_head == dev->queue_tail) return false;
+#endif
     }
+
+    *ev_out = dev->queue[dev->queue_head % INPUT_QUEUE_LEN];
+    dev->queue_head++;
+
     return true;
 }
 
-void clearInputEvents(InputDevice *dev) {}
+void clearInputEvents(InputDevice *dev) {
+#ifdef PLATFORM_URING
+    // whatever the kernel still holds belongs to the armed read
+    dev->clear_before = nanoTimestamp();
+#else
+    struct gpio_v2_line_event events[INPUT_READ_BATCH];
+
+    while (read(dev->fd, events, sizeof(events)) > 0);
+#endif
+    dev->queue_head = 0;
+    dev->queue_tail = 0;
+}
+
+int getInputFd(InputDevice *dev) {
+#ifdef PLATFORM_URING
+    // the armed read takes the edges, polling the fd would race it
+    return -1;
+#else
+    return dev->fd;
+#endif
+}
+
+bool inputExhausted(InputDevice *dev) {
+#ifdef PLATFORM_URING
+    return dev->failed;
+#else
+    return false;
+#endif
+}
 
 void deinitInputDevice(InputDevice *dev) {
     int ret;
-    
+
+#ifdef PLATFORM_URING
+    if (dev->reads_in_flight > 0) {
+        Uring_cancel(&dev->read_op);
+        Uring_waitFor(&dev->reads_in_flight);
+    }
+    Uring_unregisterFile(dev->slot);
+#endif
     ret = close(dev->fd);
     if (ret < 0) {
         fprintf(stderr, "Failed to close gpio buttons line file: %s\n", strerror(errno));
     }
+#ifdef PLATFORM_URING
+    Uring_deinit();
+#endif
 
     free(dev);
 }
 
-SoundDevice *initSoundDevice(void) {
-    FILE *file;
-    file = fopen("/sys/class/pwm/pwmchip0/export", "w");
-    fputs("0", file);
-    fclose(file);
-    return (SoundDevice *) malloc(sizeof(SoundDevice));
+static bool writePwmAttr(const char *path, const char *value) {
+    int fd;
+    ssize_t ret;
+
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    ret = write(fd, value, strlen(value));
+    close(fd);
+
+    return ret >= 0;
+}
+
+static int openPwmAttr(int channel, const char *attr) {
+    char path[64];
+    int fd;
+
+    snprintf(path, sizeof(path), PWM_DEV_PATH "/pwm%d/%s", channel, attr);
+    fd = open(path, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open pwm attribute \"%s\": %s\n", path, strerror(errno));
+    }
+
+    return fd;
+}
+
+#ifdef PLATFORM_URING
+
+static void applyTone(SoundDevice *dev);
+
+// The cur_ fields are updated as writes are queued, so a failed write puts
+// back what is known instead. The rest of a failed update completes with
+// -ECANCELED, and the next startTone or stopTone tries again.
+static bool pwmWriteDone(UringOp *op, int32_t result, uint32_t flags) {
+    PwmAttr *attr = (PwmAttr *) op;
+    SoundDevice *dev = attr->dev;
+
+    dev->writes_in_flight--;
+    if (result < 0) {
+        if (result != -ECANCELED) {
+            fprintf(stderr, "Failed to write pwm %s: %s\n", attr->name, strerror(-result));
+        }
+        if (attr == &dev->period) {
+            dev->cur_period_ns = -1;
+        } else if (attr == &dev->duty_cycle) {
+            dev->cur_duty_cycle_ns = -1;
+        } else {
+            dev->enabled = !dev->enabled;
+        }
+    } else if (dev->writes_in_flight == 0) {
+        // catch up with requests made while the update was in flight
+        applyTone(dev);
+    }
+
+    return false;
+}
+
+#endif
+
+static bool initPwmAttr(SoundDevice *dev, PwmAttr *attr, const char *name) {
+    attr->name = name;
+    attr->fd = openPwmAttr(dev->pwm_channel, name);
+    if (attr->fd < 0) return false;
+#ifdef PLATFORM_URING
+    attr->write_op.complete = pwmWriteDone;
+    attr->write_op.ctx = NULL;
+    attr->dev = dev;
+    attr->slot = Uring_registerFile(attr->fd);
+#endif
+
+    return true;
+}
+
+static void closePwmAttr(PwmAttr *attr) {
+#ifdef PLATFORM_URING
+    Uring_unregisterFile(attr->slot);
+#endif
+    close(attr->fd);
+}
+
+SoundDevice *initSoundDevice(const StationConfig *config) {
+    SoundDevice *result_dev = NULL;
+    ToneAttrs *tone;
+    char channel[16];
+    int i;
+
+    result_dev = (SoundDevice *) malloc(sizeof(SoundDevice));
+    if (result_dev == NULL) goto exit;
+
+    result_dev->pcm = NULL;
+    result_dev->pwm_channel = NO_PWM_CHANNEL;
+    if (config->audio_output != NULL) {
+        result_dev->pcm = PcmAudio_open(config->audio_output, config->tone_freqs, config->choice_count,
+            nanoTimestamp(), false);
+        if (result_dev->pcm == NULL) goto exit_free_dev;
+        goto exit;
+    }
+
+    result_dev->pwm_channel = config->pwm_channel;
+    if (result_dev->pwm_channel == NO_PWM_CHANNEL) goto exit;
+
+#ifdef PLATFORM_URING
+    if (!Uring_init()) goto exit_free_dev;
+    result_dev->writes_in_flight = 0;
+    result_dev->chain_tail = NULL;
+#endif
+
+    // fails with EBUSY if the channel is still exported from a previous run
+    snprintf(channel, sizeof(channel), "%d", result_dev->pwm_channel);
+    writePwmAttr(PWM_DEV_PATH "/export", channel);
+
+    if (!initPwmAttr(result_dev, &result_dev->period, "period")) goto exit_deinit_uring;
+    if (!initPwmAttr(result_dev, &result_dev->duty_cycle, "duty_cycle")) goto exit_close_period;
+    if (!initPwmAttr(result_dev, &result_dev->enable, "enable")) goto exit_close_duty_cycle;
+
+    for (i = 0; i < config->choice_count; i++) {
+        tone = &result_dev->tones[i];
+        tone->period_ns = NS_PER_SEC / config->tone_freqs[i];
+        tone->duty_cycle_ns = tone->period_ns / 2;
+        tone->period_len = snprintf(tone->period, sizeof(tone->period), "%d", tone->period_ns);
+        tone->duty_cycle_len = snprintf(tone->duty_cycle, sizeof(tone->duty_cycle), "%d", tone->duty_cycle_ns);
+    }
+
+    // the period is unknown until our first write, but a zero duty cycle
+    // is valid for any period so the first tone can write it first
+    result_dev->cur_period_ns = -1;
+    result_dev->cur_duty_cycle_ns = -1;
+    if (pwrite(result_dev->duty_cycle.fd, "0", 1, 0) == 1) {
+        result_dev->cur_duty_cycle_ns = 0;
+    }
+    result_dev->enabled = true;
+    result_dev->want_tone = 0;
+    stopTone(result_dev);
+
+    goto exit;
+
+exit_close_duty_cycle:
+    closePwmAttr(&result_dev->duty_cycle);
+
+exit_close_period:
+    closePwmAttr(&result_dev->period);
+
+exit_deinit_uring:
+#ifdef PLATFORM_URING
+    Uring_deinit();
+#endif
+
+exit_free_dev:
+    free(result_dev);
+    result_dev = NULL;
+
+exit:
+    return result_dev;
+}
+
+// With -DPLATFORM_URING the write is only queued, and goes out with the
+// event loop's next io_uring_enter; failures come back to pwmWriteDone.
+static bool writePwmValue(SoundDevice *dev, PwmAttr *attr, const char *value, int len) {
+#ifdef PLATFORM_URING
+    struct io_uring_sqe *sqe;
+
+    sqe = Uring_prep(&attr->write_op, IORING_OP_WRITE, attr->slot >= 0 ? attr->slot : attr->fd);
+    if (sqe == NULL) {
+        fprintf(stderr, "Failed to queue pwm %s write: io_uring is full\n", attr->name);
+        return false;
+    }
+    if (attr->slot >= 0) sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->addr = (uintptr_t) value;
+    sqe->len = len;
+    // a write only runs once the one before it in the update succeeded
+    if (dev->chain_tail != NULL) dev->chain_tail->flags |= IOSQE_IO_LINK;
+    dev->chain_tail = sqe;
+    dev->writes_in_flight++;
+#else
+    if (pwrite(attr->fd, value, len, 0) < 0) {
+        fprintf(stderr, "Failed to write pwm %s: %s\n", attr->name, strerror(errno));
+        return false;
+    }
+#endif
+
+    return true;
+}
+
+static bool writePeriod(SoundDevice *dev, const ToneAttrs *tone) {
+    if (!writePwmValue(dev, &dev->period, tone->period, tone->period_len)) {
+        dev->cur_period_ns = -1;
+        return false;
+    }
+    dev->cur_period_ns = tone->period_ns;
+
+    return true;
+}
+
+static bool writeDutyCycle(SoundDevice *dev, const ToneAttrs *tone) {
+    if (!writePwmValue(dev, &dev->duty_cycle, tone->duty_cycle, tone->duty_cycle_len)) {
+        dev->cur_duty_cycle_ns = -1;
+        return false;
+    }
+    dev->cur_duty_cycle_ns = tone->duty_cycle_ns;
+
+    return true;
+}
+
+static void setEnabled(SoundDevice *dev, bool enabled) {
+    if (dev->enabled == enabled) return;
+
+    if (!writePwmValue(dev, &dev->enable, enabled ? "1" : "0", 1)) return;
+    dev->enabled = enabled;
+}
+
+// The old fopen/fprintf/fclose path cost openat + fstat + write + close per
+// attribute, 12 syscalls per tone. Now a tone costs one pwrite for enable,
+// plus two more only when the period differs from the last tone played.
+static void applyTone(SoundDevice *dev) {
+    const ToneAttrs *tone = &dev->tones[dev->want_tone];
+
+#ifdef PLATFORM_URING
+    if (dev->writes_in_flight > 0) return;
+    // room for the whole update, so none of it is submitted before it is linked
+    if (!Uring_reserve(3)) return;
+    dev->chain_tail = NULL;
+#endif
+
+    if (!dev->want_enabled) {
+        setEnabled(dev, false);
+        return;
+    }
+
+    if (dev->cur_period_ns != tone->period_ns || dev->cur_duty_cycle_ns != tone->duty_cycle_ns) {
+        // the kernel rejects a duty cycle longer than the period, so shrink
+        // the duty cycle first when moving to a shorter period
+        if (dev->cur_duty_cycle_ns > tone->period_ns) {
+            if (!writeDutyCycle(dev, tone)) return;
+            if (!writePeriod(dev, tone)) return;
+        } else {
+            if (!writePeriod(dev, tone)) return;
+            if (!writeDutyCycle(dev, tone)) return;
+        }
+    }
+
+    setEnabled(dev, true);
 }
 
 void startTone(SoundDevice *dev, Choice choice) {
-    FILE *file;
-    const int freq = freqs[choice];
-    const int period_ns = NS_PER_SEC / freq;
-    const int duty_cycle_ns = period_ns / 2;
-
-    {
-        file = fopen("/sys/class/pwm/pwmchip0/pwm0/period", "w");
-        if (file == NULL) goto end;
-        fprintf(file, "%d", period_ns);
-        fclose(file);
-    }
-    {
-        file = fopen("/sys/class/pwm/pwmchip0/pwm0/duty_cycle", "w");
-        if (file == NULL) goto end;
-        fprintf(file, "%d", duty_cycle_ns);
-        fclose(file);
-    }
-    {
-        file = fopen("/sys/class/pwm/pwmchip0/pwm0/enable", "w");
-        if (file == NULL) goto end;
-        fputs("1", file);
-        fclose(file);
-    }
-
-end:
+    if (dev->pcm != NULL) {
+        PcmAudio_start(dev->pcm, choice, nanoTimestamp());
         return;
+    }
+    if (dev->pwm_channel == NO_PWM_CHANNEL) return;
+
+    dev->want_tone = choice;
+    dev->want_enabled = true;
+    applyTone(dev);
 }
 
 void stopTone(SoundDevice *dev) {
-    FILE *file;
-    file = fopen("/sys/class/pwm/pwmchip0/pwm0/enable", "w");
-    if (file == NULL) return;
-    fputs("0", file);
-    fclose(file);
+    if (dev->pcm != NULL) {
+        PcmAudio_stop(dev->pcm, nanoTimestamp());
+        return;
+    }
+    if (dev->pwm_channel == NO_PWM_CHANNEL) return;
+
+    dev->want_enabled = false;
+    applyTone(dev);
 }
 
 void deinitSoundDevice(SoundDevice *dev) {
-    FILE *file;
-    file = fopen("/sys/class/pwm/pwmchip0/unexport", "w");
-    fputs("0", file);
-    fclose(file);
+    char channel[16];
+
+    if (dev->pcm != NULL) PcmAudio_close(dev->pcm, nanoTimestamp());
+    if (dev->pwm_channel != NO_PWM_CHANNEL) {
+        stopTone(dev);
+#ifdef PLATFORM_URING
+        Uring_waitFor(&dev->writes_in_flight);
+#endif
+        closePwmAttr(&dev->enable);
+        closePwmAttr(&dev->duty_cycle);
+        closePwmAttr(&dev->period);
+        snprintf(channel, sizeof(channel), "%d", dev->pwm_channel);
+        writePwmAttr(PWM_DEV_PATH "/unexport", channel);
+#ifdef PLATFORM_URING
+        Uring_deinit();
+#endif
+    }
     free(dev);
 }
 
-time_t nanoTimestamp(void) {
+Nanoseconds nanoTimestamp(void) {
     struct timespec ts;
-    clock_gettime(CLOCK_REALTIME, &ts);
+    clock_gettime(PLATFORM_CLOCK_ID, &ts);
 
-    return (ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
+    return ((Nanoseconds) ts.tv_sec * NS_PER_SEC) + ts.tv_nsec;
 }
@@ -0,0 +1,48 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "realtime.h"
+
+bool enableRealtime(int cpu, int priority) {
+    struct sched_param param = { 0 };
+    cpu_set_t cpus;
+    bool ok = true;
+
+    // no page faults on the playback path once running
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        fprintf(stderr, "Failed to lock memory: %s\n", strerror(errno));
+        ok = false;
+    }
+
+    if (cpu != REALTIME_ANY_CPU) {
+        CPU_ZERO(&cpus);
+        CPU_SET(cpu, &cpus);
+        if (sched_setaffinity(0, sizeof(cpus), &cpus) < 0) {
+            fprintf(stderr, "Failed to pin to cpu %d: %s\n", cpu, strerror(errno));
+            ok = false;
+        }
+    }
+
+    param.sched_priority = priority;
+    if (sched_setscheduler(0, SCHED_FIFO, &param) < 0) {
+        fprintf(stderr, "Failed to switch to SCHED_FIFO priority %d: %s\n", priority, strerror(errno));
+        ok = false;
+    }
+
+    return ok;
+}
+
+void blockThreadSignals(void) {
+    sigset_t blocked;
+
+    sigfillset(&blocked);
+    pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+}
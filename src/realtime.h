@@ -0,0 +1,18 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <stdbool.h>
+
+#define REALTIME_ANY_CPU -1
+#define REALTIME_DEFAULT_PRIORITY 50
+
+// Locks all current and future memory, pins the process to cpu (unless
+// REALTIME_ANY_CPU) and switches it to SCHED_FIFO at priority. Each step is
+// attempted even if an earlier one fails; false if any of them failed.
+bool enableRealtime(int cpu, int priority);
+// First thing in every thread started next to the game loop: signals are for
+// the game loop, which only takes them while it waits, and one caught by
+// another thread would leave it asleep with its flags set.
+void blockThreadSignals(void);
+
+#endif
@@ -0,0 +1,161 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "recorder.h"
+
+static bool writeAll(int fd, const void *data, size_t size) {
+    const char *pos = (const char *) data;
+    ssize_t written;
+
+    while (size > 0) {
+        written = write(fd, pos, size);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to write recording: %s\n", strerror(errno));
+            return false;
+        }
+        pos += written;
+        size -= written;
+    }
+
+    return true;
+}
+
+Recorder *Recorder_open(const char *path, size_t capacity, const RecordingHeader *header) {
+    Recorder *result_rec = NULL;
+    RecordingHeader written;
+
+    result_rec = (Recorder *) malloc(sizeof(Recorder));
+    if (result_rec == NULL) goto exit;
+
+    result_rec->records = (Record *) malloc(capacity * sizeof(Record));
+    if (result_rec->records == NULL) goto exit_free_rec;
+    result_rec->len = 0;
+    result_rec->capacity = capacity;
+    result_rec->overflows = 0;
+    result_rec->last_flush_at = 0;
+    result_rec->fd = -1;
+    if (path == NULL) goto exit;
+
+    result_rec->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (result_rec->fd < 0) {
+        fprintf(stderr, "Failed to open recording \"%s\": %s\n", path, strerror(errno));
+        goto exit_free_records;
+    }
+
+    written = *header;
+    memcpy(written.magic, RECORDING_MAGIC, sizeof(written.magic));
+    written.version = RECORDING_VERSION;
+    if (!writeAll(result_rec->fd, &written, sizeof(written))) goto exit_close_fd;
+
+    goto exit;
+
+exit_close_fd:
+    close(result_rec->fd);
+
+exit_free_records:
+    free(result_rec->records);
+
+exit_free_rec:
+    free(result_rec);
+    result_rec = NULL;
+
+exit:
+    return result_rec;
+}
+
+void Recorder_append(Recorder *rec, const Record *record) {
+    if (rec->len == rec->capacity) {
+        // a memory-only recorder is drained by its owner before it fills up
+        rec->overflows++;
+        if (rec->fd < 0 || !Recorder_flush(rec)) return;
+    }
+
+    rec->records[rec->len++] = *record;
+}
+
+bool Recorder_flush(Recorder *rec) {
+    bool ok;
+
+    if (rec->fd < 0 || rec->len == 0) return true;
+
+    ok = writeAll(rec->fd, rec->records, rec->len * sizeof(Record));
+    rec->len = 0;
+
+    return ok;
+}
+
+bool Recorder_flushIdle(Recorder *rec, int64_t now) {
+    if (rec->len < rec->capacity / 2 && now - rec->last_flush_at < RECORDER_FLUSH_INTERVAL) return true;
+
+    rec->last_flush_at = now;
+
+    return Recorder_flush(rec);
+}
+
+void Recorder_close(Recorder *rec) {
+    Recorder_flush(rec);
+    if (rec->overflows > 0) {
+        fprintf(stderr, "recording buffer overflowed %llu times\n", (unsigned long long) rec->overflows);
+    }
+    if (rec->fd >= 0) close(rec->fd);
+    free(rec->records);
+    free(rec);
+}
+
+bool Recording_open(Recording *recording_out, const char *path) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open recording \"%s\": %s\n", path, strerror(errno));
+        goto error;
+    }
+    if (fstat(fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat recording: %s\n", strerror(errno));
+        goto error_close_fd;
+    }
+    if ((size_t) st.st_size < sizeof(RecordingHeader)) {
+        fprintf(stderr, "Recording \"%s\" is truncated\n", path);
+        goto error_close_fd;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map recording: %s\n", strerror(errno));
+        goto error_close_fd;
+    }
+    close(fd);
+
+    recording_out->header = (const RecordingHeader *) map;
+    recording_out->records = (const Record *) (recording_out->header + 1);
+    recording_out->count = (st.st_size - sizeof(RecordingHeader)) / sizeof(Record);
+    recording_out->map_size = st.st_size;
+
+    if (memcmp(recording_out->header->magic, RECORDING_MAGIC, sizeof(recording_out->header->magic)) != 0 ||
+        recording_out->header->version != RECORDING_VERSION) {
+        fprintf(stderr, "\"%s\" is not a version %d recording\n", path, RECORDING_VERSION);
+        Recording_close(recording_out);
+        goto error;
+    }
+
+    return true;
+
+error_close_fd:
+    close(fd);
+
+error:
+    return false;
+}
+
+void Recording_close(Recording *recording) {
+    munmap((void *) recording->header, recording->map_size);
+}
@@ -0,0 +1,87 @@
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "game.h"
+
+// Append-only binary session log: a header with the seed followed by
+// fixed-size records of every signal a station handles and every transition
+// it makes. Records are appended to a preallocated buffer and only written
+// out by Recorder_flush, which the caller runs when it has nothing else to do.
+
+#define RECORDING_MAGIC "GAMELOG1"
+#define RECORDING_VERSION 3
+#define RECORDER_DEFAULT_CAPACITY 4096
+// longest a record waits in the buffer once the caller is idle
+#define RECORDER_FLUSH_INTERVAL 1000000000
+
+typedef enum {
+    // station entered its initial state
+    record_start,
+    // arg0 = EventType, arg1 = Choice, detail = microseconds since the edge
+    record_input,
+    // arg0 = timer tag
+    record_timeout,
+    // arg0 = state left, arg1 = state entered
+    record_transition,
+} RecordKind;
+
+typedef struct {
+    // station clock when the signal was handled
+    int64_t at;
+    uint32_t detail;
+    uint8_t kind;
+    uint8_t station;
+    uint8_t arg0;
+    uint8_t arg1;
+} Record;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t station_count;
+    uint64_t seed;
+    // each station's sequence is drawn from this many choices
+    uint8_t choice_counts[MAX_STATIONS];
+    // nanoseconds without input before a station idles, 0 for never
+    int64_t idle_after;
+    // step of the attract animation while idle, 0 for none
+    int64_t attract_period;
+} RecordingHeader;
+
+typedef struct {
+    // -1 for a memory-only recorder that is never flushed
+    int fd;
+    Record *records;
+    size_t len;
+    size_t capacity;
+    int64_t last_flush_at;
+    // appends that found the buffer full and had to write on the spot
+    uint64_t overflows;
+} Recorder;
+
+// path NULL gives a memory-only recorder, which ignores header; otherwise
+// header is written out with its magic and version filled in
+Recorder *Recorder_open(const char *path, size_t capacity, const RecordingHeader *header);
+void Recorder_append(Recorder *rec, const Record *record);
+bool Recorder_flush(Recorder *rec);
+// flushes when the buffer is half full or has been held for
+// RECORDER_FLUSH_INTERVAL, so idle time is spent on few large writes
+bool Recorder_flushIdle(Recorder *rec, int64_t now);
+void Recorder_close(Recorder *rec);
+
+// a whole log mapped read-only
+typedef struct {
+    const RecordingHeader *header;
+    const Record *records;
+    size_t count;
+    size_t map_size;
+} Recording;
+
+bool Recording_open(Recording *recording_out, const char *path);
+void Recording_close(Recording *recording);
+
+#endif
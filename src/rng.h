@@ -0,0 +1,42 @@
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+// SplitMix64 used as a counter-based generator: draw k for a seed is a pure
+// function of (seed, k), so any element of a sequence can be regenerated in
+// O(1) from the seed alone, with no shared or global state.
+
+#define RNG_GAMMA 0x9e3779b97f4a7c15ULL
+
+static inline uint64_t Rng_mix(uint64_t x) {
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+
+    return x ^ (x >> 31);
+}
+
+// next seed in the stream that follows seed
+static inline uint64_t Rng_nextSeed(uint64_t seed) {
+    return Rng_mix(seed + RNG_GAMMA);
+}
+
+// draw index of seed, uniform in [0, bound) with no modulo bias (Lemire's
+// multiply-and-reject; a rejection, rare for small bounds, remixes the draw)
+static inline uint32_t Rng_uniformAt(uint64_t seed, uint64_t index, uint32_t bound) {
+    uint64_t x = Rng_mix(seed + RNG_GAMMA * (index + 1));
+    uint64_t product = (x >> 32) * bound;
+    uint32_t threshold;
+
+    if ((uint32_t) product < bound) {
+        threshold = -bound % bound;
+        while ((uint32_t) product < threshold) {
+            x = Rng_mix(x + RNG_GAMMA);
+            product = (x >> 32) * bound;
+        }
+    }
+
+    return (uint32_t) (product >> 32);
+}
+
+#endif
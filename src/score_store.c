@@ -0,0 +1,514 @@
+// offsets past 2 GiB on 32-bit boards too
+#define _FILE_OFFSET_BITS 64
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "realtime.h"
+#include "score_store.h"
+
+// two index copies, then the records from SCORE_DATA_OFFSET, which is where
+// the first segment is mapped from and so has to be a multiple of the page
+// size: 64 KiB covers 4K, 16K (Raspberry Pi 5) and 64K page kernels
+#define SCORE_SLOT_SIZE 1024
+#define SCORE_DATA_OFFSET 65536
+// Records are mapped a segment at a time as the file grows into them, so
+// they never move under the game thread. A segment is a whole number of
+// pages of any size up to 64 KiB, so every one starts on a page too.
+#define SCORE_SEGMENT_RECORDS (1 << 14)
+#define SCORE_SEGMENT_SIZE (SCORE_SEGMENT_RECORDS * sizeof(ScoreRecord))
+#define SCORE_MAX_SEGMENTS (SCORE_MAX_RECORDS / SCORE_SEGMENT_RECORDS)
+// a segment at a time, half of one ahead of the game thread
+#define SCORE_GROW_RECORDS SCORE_SEGMENT_RECORDS
+#define CACHE_LINE 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    // the copy with the higher generation is current
+    uint64_t generation;
+    // records committed: synced to disk before this index was written
+    uint64_t count;
+    uint32_t top_count;
+    // CRC-32 of the index with this field zeroed
+    uint32_t checksum;
+    ScoreRecord top[SCORE_TOP_N];
+} ScoreIndex;
+
+_Static_assert(sizeof(ScoreIndex) <= SCORE_SLOT_SIZE && 2 * SCORE_SLOT_SIZE <= SCORE_DATA_OFFSET,
+    "score index copies don't fit ahead of the records");
+
+struct ScoreStore {
+    int fd;
+    // the index copies
+    char *map;
+    // SCORE_MAX_SEGMENTS of them, the first segment_count mapped
+    ScoreRecord **segments;
+    uint64_t segment_count;
+    size_t page_size;
+    pthread_t thread;
+    // written when records are waiting to be synced
+    int wakeup_fd;
+    // written once to make the thread exit
+    int stop_fd;
+    // the sync thread's copy, written to disk on each commit
+    ScoreIndex index;
+    // the index as opened, for ScoreStore_top
+    ScoreIndex opened;
+    // written only by the sync thread
+    _Alignas(CACHE_LINE) uint64_t committed;
+    uint64_t capacity;
+    // written only by the game thread
+    _Alignas(CACHE_LINE) uint64_t appended;
+    uint64_t dropped;
+};
+
+static uint32_t crc32(const void *data, size_t size) {
+    const uint8_t *pos = (const uint8_t *) data;
+    uint32_t crc = 0xffffffff;
+    int bit;
+
+    while (size-- > 0) {
+        crc ^= *pos++;
+        for (bit = 0; bit < 8; bit++) {
+            crc = (crc >> 1) ^ (0xedb88320 & -(crc & 1));
+        }
+    }
+
+    return ~crc;
+}
+
+static uint32_t recordChecksum(const ScoreRecord *record) {
+    return crc32(record, offsetof(ScoreRecord, checksum));
+}
+
+static uint32_t indexChecksum(const ScoreIndex *index) {
+    ScoreIndex copy = *index;
+
+    copy.checksum = 0;
+
+    return crc32(&copy, sizeof(copy));
+}
+
+static bool recordValid(const ScoreRecord *record, uint64_t index) {
+    return record->index == index && record->checksum == recordChecksum(record);
+}
+
+static bool indexValid(const ScoreIndex *index) {
+    return memcmp(index->magic, SCORE_STORE_MAGIC, sizeof(index->magic)) == 0 &&
+        index->version == SCORE_STORE_VERSION &&
+        index->record_size == sizeof(ScoreRecord) &&
+        index->top_count <= SCORE_TOP_N &&
+        index->checksum == indexChecksum(index);
+}
+
+static off_t recordOffset(uint64_t index) {
+    return SCORE_DATA_OFFSET + (off_t) index * sizeof(ScoreRecord);
+}
+
+static ScoreRecord *recordAt(const ScoreStore *store, uint64_t index) {
+    return &store->segments[index / SCORE_SEGMENT_RECORDS][index % SCORE_SEGMENT_RECORDS];
+}
+
+static void wakeUp(int fd) {
+    uint64_t one = 1;
+
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR);
+}
+
+static int64_t monotonicMs(void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// msync wants a page-aligned start
+static bool syncMapped(ScoreStore *store, const void *from, size_t len) {
+    size_t offset = (uintptr_t) from % store->page_size;
+
+    if (msync((char *) from - offset, len + offset, MS_SYNC) < 0) {
+        fprintf(stderr, "Failed to sync scores: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+// records [from, to), one segment at a time
+static bool syncRecords(ScoreStore *store, uint64_t from, uint64_t to) {
+    uint64_t end;
+
+    while (from < to) {
+        end = (from / SCORE_SEGMENT_RECORDS + 1) * SCORE_SEGMENT_RECORDS;
+        if (end > to) end = to;
+        if (!syncMapped(store, recordAt(store, from), (end - from) * sizeof(ScoreRecord))) return false;
+        from = end;
+    }
+
+    return true;
+}
+
+// highest round first, earlier games ahead of later ones with the same
+static void addTop(ScoreIndex *index, const ScoreRecord *record) {
+    uint32_t i = index->top_count;
+
+    if (i == SCORE_TOP_N) {
+        if (record->round <= index->top[i - 1].round) return;
+        i--;
+    } else {
+        index->top_count++;
+    }
+    while (i > 0 && index->top[i - 1].round < record->round) {
+        index->top[i] = index->top[i - 1];
+        i--;
+    }
+    index->top[i] = *record;
+}
+
+// the new copy goes over the older one, so the current one survives a
+// write torn by a power cut
+static bool writeIndex(ScoreStore *store, uint64_t count) {
+    ScoreIndex *index = &store->index;
+
+    index->count = count;
+    index->generation++;
+    index->checksum = indexChecksum(index);
+    memcpy(store->map + (index->generation % 2) * SCORE_SLOT_SIZE, index, sizeof(*index));
+
+    return syncMapped(store, store->map, 2 * SCORE_SLOT_SIZE);
+}
+
+// the segments holding every record below capacity
+static bool mapSegments(ScoreStore *store, uint64_t capacity) {
+    void *map;
+
+    while (store->segment_count * SCORE_SEGMENT_RECORDS < capacity) {
+        map = mmap(NULL, SCORE_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, store->fd,
+            recordOffset(store->segment_count * SCORE_SEGMENT_RECORDS));
+        if (map == MAP_FAILED) {
+            fprintf(stderr, "Failed to map scores: %s\n", strerror(errno));
+            return false;
+        }
+        store->segments[store->segment_count++] = (ScoreRecord *) map;
+    }
+
+    return true;
+}
+
+static void unmapAll(ScoreStore *store) {
+    uint64_t i;
+
+    for (i = 0; i < store->segment_count; i++) {
+        munmap(store->segments[i], SCORE_SEGMENT_SIZE);
+    }
+    free(store->segments);
+    munmap(store->map, SCORE_DATA_OFFSET);
+}
+
+static bool grow(ScoreStore *store, uint64_t capacity) {
+    int err;
+
+    if (capacity > SCORE_MAX_RECORDS) capacity = SCORE_MAX_RECORDS;
+    if (capacity <= store->capacity) return true;
+
+    // allocated rather than ftruncated: a store to a hole in a full file
+    // system would raise SIGBUS in the game thread
+    err = posix_fallocate(store->fd, 0, recordOffset(capacity));
+    if (err != 0) {
+        fprintf(stderr, "Failed to grow score file: %s\n", strerror(err));
+        return false;
+    }
+    // published only once mapped, the game thread writes as soon as it sees it
+    if (!mapSegments(store, capacity)) return false;
+    __atomic_store_n(&store->capacity, capacity, __ATOMIC_RELEASE);
+
+    return true;
+}
+
+static bool commit(ScoreStore *store, uint64_t appended) {
+    uint64_t i;
+
+    // records first, so the index never counts one that isn't on disk
+    if (!syncRecords(store, store->index.count, appended)) return false;
+    for (i = store->index.count; i < appended; i++) {
+        addTop(&store->index, recordAt(store, i));
+    }
+    if (!writeIndex(store, appended)) return false;
+    __atomic_store_n(&store->committed, appended, __ATOMIC_SEQ_CST);
+
+    // keep well ahead of the game thread; if the disk is full, games are
+    // dropped once it catches up, and the next commit tries again
+    if (appended + SCORE_GROW_RECORDS / 2 > store->capacity) {
+        grow(store, store->capacity + SCORE_GROW_RECORDS);
+    }
+
+    return true;
+}
+
+// Sleeps until a record is waiting, then until the batch fills or its
+// interval passes. Nothing wakes it up while no games end.
+static void *syncLoop(void *arg) {
+    ScoreStore *store = (ScoreStore *) arg;
+    struct pollfd fds[2];
+    int64_t batch_started_at = -1;
+    uint64_t appended, count;
+    bool stopping = false;
+    int timeout;
+
+    blockThreadSignals();
+
+    fds[0].fd = store->wakeup_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = store->stop_fd;
+    fds[1].events = POLLIN;
+
+    for (;;) {
+        appended = __atomic_load_n(&store->appended, __ATOMIC_SEQ_CST);
+        if (appended == store->index.count) {
+            if (stopping) break;
+            timeout = -1;
+        } else {
+            if (batch_started_at < 0) batch_started_at = monotonicMs();
+            timeout = (int) (batch_started_at + SCORE_SYNC_INTERVAL_MS - monotonicMs());
+            if (stopping || appended - store->index.count >= SCORE_SYNC_BATCH || timeout <= 0) {
+                if (!commit(store, appended)) break;
+                batch_started_at = -1;
+                continue;
+            }
+        }
+
+        if (poll(fds, 2, timeout) < 0) {
+            if (errno == EINTR) continue;
+            fprintf(stderr, "Failed to wait for scores: %s\n", strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0) stopping = true;
+        // only a reset, appended is read again at the top
+        if (fds[0].revents != 0 && read(store->wakeup_fd, &count, sizeof(count)) < 0) count = 0;
+    }
+
+    return NULL;
+}
+
+static bool createIndex(ScoreStore *store) {
+    memset(&store->index, 0, sizeof(store->index));
+    memcpy(store->index.magic, SCORE_STORE_MAGIC, sizeof(store->index.magic));
+    store->index.version = SCORE_STORE_VERSION;
+    store->index.record_size = sizeof(ScoreRecord);
+
+    return grow(store, SCORE_GROW_RECORDS) && writeIndex(store, 0);
+}
+
+static bool loadIndex(ScoreStore *store, const char *path) {
+    const ScoreIndex *slots[2];
+    int current;
+
+    slots[0] = (const ScoreIndex *) store->map;
+    slots[1] = (const ScoreIndex *) (store->map + SCORE_SLOT_SIZE);
+    if (!indexValid(slots[0]) && !indexValid(slots[1])) {
+        fprintf(stderr, "Failed to open scores \"%s\": not a score file, or its index is corrupt\n", path);
+        return false;
+    }
+    if (!indexValid(slots[1])) {
+        current = 0;
+    } else if (!indexValid(slots[0])) {
+        current = 1;
+    } else {
+        current = slots[1]->generation > slots[0]->generation;
+    }
+    store->index = *slots[current];
+    if (store->index.count > store->capacity) store->index.count = store->capacity;
+
+    return true;
+}
+
+// Picks up records synced after the last index was committed, then clears
+// anything past them, so that a record left from before a crash can't later
+// pass for one the next run didn't get to sync.
+static bool recover(ScoreStore *store) {
+    static const ScoreRecord zero;
+    uint64_t end, stale_from = 0, stale_to = 0, i;
+
+    for (end = store->index.count; end < store->capacity; end++) {
+        if (!recordValid(recordAt(store, end), end)) break;
+        addTop(&store->index, recordAt(store, end));
+    }
+    for (i = end; i < store->capacity; i++) {
+        if (memcmp(recordAt(store, i), &zero, sizeof(zero)) == 0) continue;
+        if (stale_to == 0) stale_from = i;
+        *recordAt(store, i) = zero;
+        stale_to = i + 1;
+    }
+    if (stale_to > 0 && !syncRecords(store, stale_from, stale_to)) return false;
+    if (end > store->index.count) {
+        fprintf(stderr, "recovered %llu uncommitted scores\n",
+            (unsigned long long) (end - store->index.count));
+        if (!writeIndex(store, end)) return false;
+    }
+
+    return true;
+}
+
+ScoreStore *ScoreStore_open(const char *path) {
+    ScoreStore *result_store = NULL;
+    struct stat st;
+    void *map;
+    int err;
+
+    result_store = (ScoreStore *) aligned_alloc(CACHE_LINE, sizeof(ScoreStore));
+    if (result_store == NULL) goto exit;
+    memset(result_store, 0, sizeof(ScoreStore));
+    result_store->page_size = sysconf(_SC_PAGESIZE);
+    if (SCORE_DATA_OFFSET % result_store->page_size != 0) {
+        fprintf(stderr, "Failed to open scores: %zu byte pages are too large\n", result_store->page_size);
+        goto exit_free_store;
+    }
+
+    result_store->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (result_store->fd < 0) {
+        fprintf(stderr, "Failed to open scores \"%s\": %s\n", path, strerror(errno));
+        goto exit_free_store;
+    }
+    if (fstat(result_store->fd, &st) < 0) {
+        fprintf(stderr, "Failed to stat scores: %s\n", strerror(errno));
+        goto exit_close_fd;
+    }
+    if (st.st_size != 0 && st.st_size < SCORE_DATA_OFFSET) {
+        fprintf(stderr, "Failed to open scores \"%s\": not a score file\n", path);
+        goto exit_close_fd;
+    }
+
+    result_store->segments = (ScoreRecord **) calloc(SCORE_MAX_SEGMENTS, sizeof(ScoreRecord *));
+    if (result_store->segments == NULL) goto exit_close_fd;
+    map = mmap(NULL, SCORE_DATA_OFFSET, PROT_READ | PROT_WRITE, MAP_SHARED, result_store->fd, 0);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map scores: %s\n", strerror(errno));
+        free(result_store->segments);
+        goto exit_close_fd;
+    }
+    result_store->map = (char *) map;
+
+    if (st.st_size == 0) {
+        if (!createIndex(result_store)) goto exit_unmap;
+    } else {
+        result_store->capacity = (st.st_size - SCORE_DATA_OFFSET) / sizeof(ScoreRecord);
+        if (result_store->capacity > SCORE_MAX_RECORDS) result_store->capacity = SCORE_MAX_RECORDS;
+        if (!mapSegments(result_store, result_store->capacity)) goto exit_unmap;
+        if (!loadIndex(result_store, path) || !recover(result_store)) goto exit_unmap;
+        if (result_store->index.count + SCORE_GROW_RECORDS / 2 > result_store->capacity &&
+                !grow(result_store, result_store->capacity + SCORE_GROW_RECORDS)) {
+            goto exit_unmap;
+        }
+    }
+    if (result_store->index.count >= SCORE_MAX_RECORDS) {
+        fprintf(stderr, "Score file \"%s\" is full at %llu games, new scores won't be kept\n",
+            path, (unsigned long long) SCORE_MAX_RECORDS);
+    }
+    result_store->opened = result_store->index;
+    result_store->committed = result_store->index.count;
+    result_store->appended = result_store->index.count;
+
+    result_store->wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (result_store->wakeup_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto exit_unmap;
+    }
+    result_store->stop_fd = eventfd(0, EFD_CLOEXEC);
+    if (result_store->stop_fd < 0) {
+        fprintf(stderr, "Failed to create eventfd: %s\n", strerror(errno));
+        goto exit_close_wakeup;
+    }
+
+    err = pthread_create(&result_store->thread, NULL, syncLoop, result_store);
+    if (err != 0) {
+        fprintf(stderr, "Failed to start score sync thread: %s\n", strerror(err));
+        goto exit_close_stop;
+    }
+
+    goto exit;
+
+exit_close_stop:
+    close(result_store->stop_fd);
+
+exit_close_wakeup:
+    close(result_store->wakeup_fd);
+
+exit_unmap:
+    unmapAll(result_store);
+
+exit_close_fd:
+    close(result_store->fd);
+
+exit_free_store:
+    free(result_store);
+    result_store = NULL;
+
+exit:
+    return result_store;
+}
+
+int ScoreStore_top(const ScoreStore *store, const ScoreRecord **top_out) {
+    *top_out = store->opened.top;
+
+    return (int) store->opened.top_count;
+}
+
+void ScoreStore_append(ScoreStore *store, int station, uint32_t round, uint64_t seed,
+    int64_t ended_at, int64_t duration) {
+    uint64_t index = store->appended;
+    ScoreRecord *record;
+    uint64_t pending;
+
+    // the sync thread grows the file well before this, unless the disk is
+    // full or has been stuck for thousands of games
+    if (index >= __atomic_load_n(&store->capacity, __ATOMIC_ACQUIRE)) {
+        if (store->dropped++ == 0) {
+            fprintf(stderr, "Score file can't take game %llu, dropping scores until it can\n",
+                (unsigned long long) index + 1);
+        }
+        return;
+    }
+
+    record = recordAt(store, index);
+    memset(record, 0, sizeof(*record));
+    record->index = index;
+    record->seed = seed;
+    record->ended_at = ended_at;
+    record->duration = duration;
+    record->round = round;
+    record->station = (uint8_t) station;
+    record->checksum = recordChecksum(record);
+
+    // sequentially consistent with the sync thread's committed and appended,
+    // so it can't go to sleep on a record it hasn't seen without being woken
+    __atomic_store_n(&store->appended, index + 1, __ATOMIC_SEQ_CST);
+    pending = index + 1 - __atomic_load_n(&store->committed, __ATOMIC_SEQ_CST);
+    if (pending == 1 || pending == SCORE_SYNC_BATCH) wakeUp(store->wakeup_fd);
+}
+
+void ScoreStore_close(ScoreStore *store) {
+    wakeUp(store->stop_fd);
+    pthread_join(store->thread, NULL);
+    if (store->dropped > 0) {
+        fprintf(stderr, "%llu scores dropped\n", (unsigned long long) store->dropped);
+    }
+    close(store->stop_fd);
+    close(store->wakeup_fd);
+    unmapAll(store);
+    close(store->fd);
+    free(store);
+}
@@ -0,0 +1,66 @@
+#ifndef SCORE_STORE_H
+#define SCORE_STORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Results of every game played, kept across runs in an append-only file of
+// fixed-size records. The game thread only copies a record into a shared
+// mapping of the file; a sync thread writes finished batches to disk and
+// then commits them in an index at the front of the file, which also holds
+// the best SCORE_TOP_N games. So a crash or power cut loses at most the
+// batch not yet synced and never touches records committed before it.
+//
+// The file grows as games are played, up to SCORE_MAX_RECORDS of them;
+// after that, or if the disk fills up, further games are dropped with a
+// warning.
+//
+// The index is kept twice and rewritten alternately, each copy with a
+// generation and a checksum, so a torn index write leaves the other copy.
+// Records carry their own position and checksum: on open, records synced
+// after the last committed index are recovered by scanning forward until
+// the first one that doesn't check out.
+
+#define SCORE_STORE_MAGIC "GAMESCR1"
+// 2 moved the records to 64 KiB in, for larger pages
+#define SCORE_STORE_VERSION 2
+#define SCORE_TOP_N 10
+// 48 GiB of records
+#define SCORE_MAX_RECORDS ((uint64_t) 1 << 30)
+// records are synced once this many are waiting, or SCORE_SYNC_INTERVAL_MS
+// after the first of them
+#define SCORE_SYNC_BATCH 32
+#define SCORE_SYNC_INTERVAL_MS 2000
+
+typedef struct {
+    // position in the file, so a record left over from an earlier write of
+    // another slot can't pass for this one
+    uint64_t index;
+    uint64_t seed;
+    // CLOCK_REALTIME at game over
+    int64_t ended_at;
+    // from the start of the game to game over, in station time
+    int64_t duration;
+    // the round the game was lost in
+    uint32_t round;
+    uint8_t station;
+    uint8_t reserved[7];
+    // CRC-32 of everything above
+    uint32_t checksum;
+} ScoreRecord;
+
+typedef struct ScoreStore ScoreStore;
+
+// creates the file if it doesn't exist yet; NULL on errors, and for a file
+// whose index copies are both unreadable rather than risk overwriting it
+ScoreStore *ScoreStore_open(const char *path);
+// The best games, highest round first, as committed when the store was
+// opened; read straight from the index. Returns the count.
+int ScoreStore_top(const ScoreStore *store, const ScoreRecord **top_out);
+// never blocks on the disk: at most grows the file every few thousand games
+void ScoreStore_append(ScoreStore *store, int station, uint32_t round, uint64_t seed,
+    int64_t ended_at, int64_t duration);
+// syncs and commits whatever is left
+void ScoreStore_close(ScoreStore *store);
+
+#endif
@@ -0,0 +1,151 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "telemetry.h"
+
+#define COUNTER_WORDS (sizeof(TelemetryCounters) / sizeof(uint64_t))
+
+Telemetry *Telemetry_open(const char *name, int station_count) {
+    Telemetry *result_telemetry = NULL;
+    TelemetrySegment *segment;
+    int fd;
+
+    if (station_count > MAX_STATIONS) station_count = MAX_STATIONS;
+
+    result_telemetry = (Telemetry *) malloc(sizeof(Telemetry));
+    if (result_telemetry == NULL) goto exit;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to create telemetry segment \"%s\": %s\n", name, strerror(errno));
+        goto exit_free_telemetry;
+    }
+    if (ftruncate(fd, sizeof(TelemetrySegment)) < 0) {
+        fprintf(stderr, "Failed to size telemetry segment: %s\n", strerror(errno));
+        goto exit_close_unlink;
+    }
+    segment = (TelemetrySegment *) mmap(NULL, sizeof(TelemetrySegment), PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Failed to map telemetry segment: %s\n", strerror(errno));
+        goto exit_close_unlink;
+    }
+    close(fd);
+
+    // fresh from ftruncate, so everything else is already zero
+    segment->version = TELEMETRY_VERSION;
+    segment->station_count = station_count;
+    segment->pid = getpid();
+    // the magic goes last: readers ignore the segment until it is there
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(segment->magic, TELEMETRY_MAGIC, sizeof(segment->magic));
+
+    result_telemetry->segment = segment;
+    result_telemetry->name = name;
+    goto exit;
+
+exit_close_unlink:
+    close(fd);
+    shm_unlink(name);
+
+exit_free_telemetry:
+    free(result_telemetry);
+    result_telemetry = NULL;
+
+exit:
+    return result_telemetry;
+}
+
+void Telemetry_publishStation(Telemetry *telemetry, int station, const TelemetryCounters *counters) {
+    TelemetryStation *slot;
+    const uint64_t *from = (const uint64_t *) counters;
+    uint64_t *to;
+    size_t i;
+
+    if (station >= MAX_STATIONS) return;
+    slot = &telemetry->segment->stations[station];
+    to = (uint64_t *) &slot->counters;
+
+    // only this thread writes, so a plain increment is enough to go odd
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    for (i = 0; i < COUNTER_WORDS; i++) {
+        __atomic_store_n(&to[i], from[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->sequence, slot->sequence + 1, __ATOMIC_RELEASE);
+}
+
+void Telemetry_publishLoop(Telemetry *telemetry, uint64_t iterations, uint64_t rate) {
+    __atomic_store_n(&telemetry->segment->loop_iterations, iterations, __ATOMIC_RELAXED);
+    __atomic_store_n(&telemetry->segment->loop_rate, rate, __ATOMIC_RELAXED);
+}
+
+void Telemetry_close(Telemetry *telemetry) {
+    munmap(telemetry->segment, sizeof(TelemetrySegment));
+    shm_unlink(telemetry->name);
+    free(telemetry);
+}
+
+const TelemetrySegment *Telemetry_map(const char *name) {
+    const TelemetrySegment *segment;
+    struct stat st;
+    int fd;
+
+    fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open telemetry segment \"%s\": %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(TelemetrySegment)) {
+        fprintf(stderr, "Telemetry segment \"%s\" is not ready\n", name);
+        close(fd);
+        return NULL;
+    }
+    segment = (const TelemetrySegment *) mmap(NULL, sizeof(TelemetrySegment), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (segment == MAP_FAILED) {
+        fprintf(stderr, "Failed to map telemetry segment: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    if (memcmp(segment->magic, TELEMETRY_MAGIC, sizeof(segment->magic)) != 0 ||
+        segment->version != TELEMETRY_VERSION) {
+        fprintf(stderr, "\"%s\" is not a version %d telemetry segment\n", name, TELEMETRY_VERSION);
+        Telemetry_unmap(segment);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return segment;
+}
+
+void Telemetry_unmap(const TelemetrySegment *segment) {
+    munmap((void *) segment, sizeof(TelemetrySegment));
+}
+
+void Telemetry_readStation(const TelemetrySegment *segment, int station, TelemetryCounters *counters_out) {
+    const TelemetryStation *slot = &segment->stations[station];
+    const uint64_t *from = (const uint64_t *) &slot->counters;
+    uint64_t *to = (uint64_t *) counters_out;
+    uint32_t before, after;
+    size_t i;
+
+    do {
+        before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        for (i = 0; i < COUNTER_WORDS; i++) {
+            to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    } while ((before & 1) != 0 || before != after);
+}
+
+uint64_t Telemetry_readWord(const uint64_t *word) {
+    return __atomic_load_n(word, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,66 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "game.h"
+
+// Live counters published to a POSIX shared memory segment (/dev/shm/NAME)
+// for external monitors. The game is the only writer and never waits on a
+// reader: each station's counters sit behind a seqlock, and readers retry
+// until they get a snapshot no write overlapped. Loop counters are single
+// words updated atomically.
+
+#define TELEMETRY_MAGIC "GAMETLM1"
+#define TELEMETRY_VERSION 1
+
+// every field is a 64-bit word so it can be copied with atomic loads
+typedef struct {
+    uint64_t state;
+    uint64_t sequence_len;
+    uint64_t games_played;
+    uint64_t high_score;
+    uint64_t input_events;
+    uint64_t timeouts;
+} TelemetryCounters;
+
+typedef struct {
+    // odd while the game is writing the counters
+    uint32_t sequence;
+    uint32_t reserved;
+    TelemetryCounters counters;
+} TelemetryStation;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t station_count;
+    int64_t pid;
+    uint64_t loop_iterations;
+    // iterations during the last full second
+    uint64_t loop_rate;
+    TelemetryStation stations[MAX_STATIONS];
+} TelemetrySegment;
+
+typedef struct {
+    TelemetrySegment *segment;
+    const char *name;
+} Telemetry;
+
+// creates (or replaces) the segment; NULL on failure
+Telemetry *Telemetry_open(const char *name, int station_count);
+void Telemetry_publishStation(Telemetry *telemetry, int station, const TelemetryCounters *counters);
+void Telemetry_publishLoop(Telemetry *telemetry, uint64_t iterations, uint64_t rate);
+// unlinks the segment, so monitors stop seeing a unit that has exited
+void Telemetry_close(Telemetry *telemetry);
+
+// reader side: map an existing segment read-only
+const TelemetrySegment *Telemetry_map(const char *name);
+void Telemetry_unmap(const TelemetrySegment *segment);
+// consistent snapshot of one station, retrying while the game writes
+void Telemetry_readStation(const TelemetrySegment *segment, int station, TelemetryCounters *counters_out);
+uint64_t Telemetry_readWord(const uint64_t *word);
+
+#endif
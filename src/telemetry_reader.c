@@ -0,0 +1,81 @@
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "game.h"
+#include "telemetry.h"
+
+// Prints the counters a running game publishes with --telemetry NAME, once
+// or every second with --watch. Only maps the segment read-only, so it can
+// never disturb the game.
+
+static bool printCounters(const TelemetrySegment *segment) {
+    unsigned int station_count = segment->station_count;
+    TelemetryCounters counters;
+    unsigned int i;
+
+    // the segment is only as trustworthy as whoever created it
+    if (station_count > MAX_STATIONS) {
+        fprintf(stderr, "Telemetry segment claims %u stations, at most %d are supported\n",
+            station_count, MAX_STATIONS);
+        return false;
+    }
+
+    printf("pid %lld, %llu loop iterations, %llu/s\n",
+        (long long) segment->pid,
+        (unsigned long long) Telemetry_readWord(&segment->loop_iterations),
+        (unsigned long long) Telemetry_readWord(&segment->loop_rate));
+    for (i = 0; i < station_count; i++) {
+        Telemetry_readStation(segment, i, &counters);
+        printf("station %u: %-19s round %llu, %llu games, high score %llu, "
+            "%llu inputs, %llu timeouts\n",
+            i,
+            State_name((State) counters.state),
+            (unsigned long long) counters.sequence_len,
+            (unsigned long long) counters.games_played,
+            (unsigned long long) counters.high_score,
+            (unsigned long long) counters.input_events,
+            (unsigned long long) counters.timeouts);
+    }
+    fflush(stdout);
+
+    return true;
+}
+
+int main(int argc, char **argv) {
+    const TelemetrySegment *segment;
+    const char *name = NULL;
+    bool watch = false;
+    bool ok;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--watch") == 0) {
+            watch = true;
+        } else if (name == NULL) {
+            name = argv[i];
+        } else {
+            name = NULL;
+            break;
+        }
+    }
+    if (name == NULL) {
+        fprintf(stderr, "usage: %s NAME [--watch]\n", argv[0]);
+        return 2;
+    }
+
+    segment = Telemetry_map(name);
+    if (segment == NULL) return 1;
+
+    ok = printCounters(segment);
+    while (ok && watch) {
+        sleep(1);
+        printf("\n");
+        ok = printCounters(segment);
+    }
+
+    Telemetry_unmap(segment);
+
+    return ok ? 0 : 1;
+}
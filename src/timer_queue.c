@@ -0,0 +1,104 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "timer_queue.h"
+
+static void place(TimerQueue *queue, Timer *timer, int index) {
+    queue->heap[index] = timer;
+    timer->heap_index = index;
+}
+
+static void siftUp(TimerQueue *queue, int index) {
+    Timer *timer = queue->heap[index];
+    int parent;
+
+    while (index > 0) {
+        parent = (index - 1) / 2;
+        if (queue->heap[parent]->deadline <= timer->deadline) break;
+        place(queue, queue->heap[parent], index);
+        index = parent;
+    }
+    place(queue, timer, index);
+}
+
+static void siftDown(TimerQueue *queue, int index) {
+    Timer *timer = queue->heap[index];
+    int child;
+
+    for (;;) {
+        child = 2 * index + 1;
+        if (child >= queue->len) break;
+        if (child + 1 < queue->len && queue->heap[child + 1]->deadline < queue->heap[child]->deadline) {
+            child++;
+        }
+        if (timer->deadline <= queue->heap[child]->deadline) break;
+        place(queue, queue->heap[child], index);
+        index = child;
+    }
+    place(queue, timer, index);
+}
+
+void TimerQueue_init(TimerQueue *queue, Timer **storage, int capacity) {
+    queue->heap = storage;
+    queue->len = 0;
+    queue->capacity = capacity;
+}
+
+void Timer_init(Timer *timer, int tag, void *owner) {
+    timer->deadline = 0;
+    timer->heap_index = -1;
+    timer->tag = tag;
+    timer->owner = owner;
+}
+
+bool Timer_active(const Timer *timer) {
+    return timer->heap_index >= 0;
+}
+
+void TimerQueue_schedule(TimerQueue *queue, Timer *timer, int64_t deadline) {
+    int64_t old_deadline = timer->deadline;
+
+    timer->deadline = deadline;
+
+    if (!Timer_active(timer)) {
+        assert(queue->len < queue->capacity);
+        place(queue, timer, queue->len++);
+        siftUp(queue, timer->heap_index);
+    } else if (deadline < old_deadline) {
+        siftUp(queue, timer->heap_index);
+    } else {
+        siftDown(queue, timer->heap_index);
+    }
+}
+
+void TimerQueue_cancel(TimerQueue *queue, Timer *timer) {
+    int index = timer->heap_index;
+    Timer *last;
+
+    if (index < 0) return;
+
+    timer->heap_index = -1;
+    last = queue->heap[--queue->len];
+    if (last == timer) return;
+
+    place(queue, last, index);
+    if (index > 0 && queue->heap[(index - 1) / 2]->deadline > last->deadline) {
+        siftUp(queue, index);
+    } else {
+        siftDown(queue, index);
+    }
+}
+
+Timer *TimerQueue_peek(const TimerQueue *queue) {
+    return queue->len > 0 ? queue->heap[0] : NULL;
+}
+
+Timer *TimerQueue_popExpired(TimerQueue *queue, int64_t now) {
+    Timer *timer = TimerQueue_peek(queue);
+
+    if (timer == NULL || timer->deadline > now) return NULL;
+    TimerQueue_cancel(queue, timer);
+
+    return timer;
+}
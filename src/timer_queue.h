@@ -0,0 +1,37 @@
+#ifndef TIMER_QUEUE_H
+#define TIMER_QUEUE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Binary min-heap of timers ordered by deadline. Timers are embedded in their
+// owners and the queue only holds pointers into caller-provided storage, so
+// scheduling never allocates. Insert, cancel and reschedule are O(log n).
+
+typedef struct Timer {
+    // nanoseconds, in whatever clock the owner schedules against
+    int64_t deadline;
+    // position in the heap, -1 while not scheduled
+    int heap_index;
+    int tag;
+    void *owner;
+} Timer;
+
+typedef struct {
+    Timer **heap;
+    int len;
+    int capacity;
+} TimerQueue;
+
+void TimerQueue_init(TimerQueue *queue, Timer **storage, int capacity);
+void Timer_init(Timer *timer, int tag, void *owner);
+bool Timer_active(const Timer *timer);
+// (re)arms timer for the absolute deadline
+void TimerQueue_schedule(TimerQueue *queue, Timer *timer, int64_t deadline);
+void TimerQueue_cancel(TimerQueue *queue, Timer *timer);
+// earliest timer, or NULL when none are scheduled
+Timer *TimerQueue_peek(const TimerQueue *queue);
+// unschedules and returns the earliest timer whose deadline is <= now
+Timer *TimerQueue_popExpired(TimerQueue *queue, int64_t now);
+
+#endif
@@ -0,0 +1,160 @@
+#ifdef GAME_TRACE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "histogram.h"
+#include "trace.h"
+
+typedef enum {
+    // a handler called with a signal
+    trace_signal,
+    // the machine moved to another state
+    trace_transition,
+} TraceKind;
+
+typedef struct {
+    Nanoseconds at;
+    // for a transition, how long the state left was held, in microseconds
+    uint32_t dwell_us;
+    uint8_t kind;
+    uint8_t station;
+    uint8_t state;
+    // the signal, or the state entered
+    uint8_t arg;
+} TraceRecord;
+
+static TraceRecord ring[TRACE_RING_SIZE];
+static uint64_t ring_written = 0;
+static Nanoseconds entered_at[MAX_STATIONS];
+static bool entered_known[MAX_STATIONS];
+static Histogram dwell[STATE_COUNT];
+static bool dwell_ready = false;
+static uint64_t transition_counts[STATE_COUNT][STATE_COUNT];
+static uint64_t signal_counts[SIGNAL_COUNT];
+
+static TraceRecord *nextRecord(void) {
+    return &ring[ring_written++ & (TRACE_RING_SIZE - 1)];
+}
+
+void Trace_signal(int station, State state, Signal signal, Nanoseconds at) {
+    TraceRecord *record = nextRecord();
+
+    record->at = at;
+    record->dwell_us = 0;
+    record->kind = trace_signal;
+    record->station = (uint8_t) station;
+    record->state = (uint8_t) state;
+    record->arg = (uint8_t) signal;
+    signal_counts[signal]++;
+}
+
+void Trace_transition(int station, State from, State to, Nanoseconds at) {
+    TraceRecord *record = nextRecord();
+    Nanoseconds held = 0;
+    int i;
+
+    if (!dwell_ready) {
+        for (i = 0; i < STATE_COUNT; i++) Histogram_init(&dwell[i]);
+        dwell_ready = true;
+    }
+    if (station < MAX_STATIONS) {
+        if (entered_known[station]) {
+            held = at - entered_at[station];
+            Histogram_record(&dwell[from], held);
+        }
+        entered_at[station] = at;
+        entered_known[station] = true;
+    }
+    transition_counts[from][to]++;
+
+    record->at = at;
+    record->dwell_us = held / 1000 > UINT32_MAX ? UINT32_MAX : (uint32_t) (held / 1000);
+    record->kind = trace_transition;
+    record->station = (uint8_t) station;
+    record->state = (uint8_t) from;
+    record->arg = (uint8_t) to;
+}
+
+void Trace_printStats(FILE *file) {
+    uint64_t rounds;
+    int from, to, signal;
+
+    if (!dwell_ready) return;
+
+    fprintf(file, "dwell time per state:\n");
+    for (from = 0; from < STATE_COUNT; from++) {
+        if (dwell[from].total == 0) continue;
+        fprintf(file, "  ");
+        Histogram_print(&dwell[from], file, State_name(from));
+    }
+
+    fprintf(file, "transitions:\n");
+    for (from = 0; from < STATE_COUNT; from++) {
+        for (to = 0; to < STATE_COUNT; to++) {
+            if (transition_counts[from][to] == 0) continue;
+            fprintf(file, "  %s -> %s: %llu\n", State_name(from), State_name(to),
+                (unsigned long long) transition_counts[from][to]);
+        }
+    }
+
+    // every round is entered through start_playback_mode
+    rounds = 0;
+    for (from = 0; from < STATE_COUNT; from++) {
+        rounds += transition_counts[from][state_start_playback_mode];
+    }
+    fprintf(file, "handler calls per round:");
+    for (signal = 0; signal < SIGNAL_COUNT; signal++) {
+        fprintf(file, " %s %.2f", Signal_name(signal),
+            rounds > 0 ? (double) signal_counts[signal] / rounds : 0.0);
+    }
+    fprintf(file, "\n");
+}
+
+// Chrome trace event format: one complete ("X") event per state held and an
+// instant ("i") event per handler call, one track per station
+bool Trace_export(const char *path) {
+    const TraceRecord *record;
+    uint64_t first, i;
+    bool separate = false;
+    FILE *file;
+
+    file = fopen(path, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Failed to open trace \"%s\": %s\n", path, strerror(errno));
+        return false;
+    }
+
+    first = ring_written > TRACE_RING_SIZE ? ring_written - TRACE_RING_SIZE : 0;
+    fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (i = first; i < ring_written; i++) {
+        record = &ring[i & (TRACE_RING_SIZE - 1)];
+        if (separate) fprintf(file, ",\n");
+        separate = true;
+        if (record->kind == trace_transition) {
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"dur\":%u,\"args\":{\"next\":\"%s\"}}",
+                State_name(record->state), record->station,
+                (record->at - (Nanoseconds) record->dwell_us * 1000) / 1e3, record->dwell_us,
+                State_name(record->arg));
+        } else {
+            fprintf(file, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"pid\":1,\"tid\":%d,"
+                "\"ts\":%.3f,\"args\":{\"state\":\"%s\"}}",
+                Signal_name(record->arg), record->station, record->at / 1e3,
+                State_name(record->state));
+        }
+    }
+    fprintf(file, "\n]}\n");
+
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Failed to write trace: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+#endif
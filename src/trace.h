@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "game.h"
+
+// Optional tracing of state machine dispatch, compiled in with -DGAME_TRACE.
+// Every handler call and transition goes into a fixed-size per-process ring
+// (the newest TRACE_RING_SIZE records survive), and time spent in each state
+// is folded into per-state dwell histograms as it happens. The ring exports
+// as Chrome trace event JSON, which Perfetto and chrome://tracing open.
+// Without GAME_TRACE the TRACE_* macros expand to nothing.
+
+#define TRACE_RING_SIZE (1 << 16)
+
+#ifdef GAME_TRACE
+
+void Trace_signal(int station, State state, Signal signal, Nanoseconds at);
+void Trace_transition(int station, State from, State to, Nanoseconds at);
+void Trace_printStats(FILE *file);
+bool Trace_export(const char *path);
+
+#define TRACE_SIGNAL(station, state, signal, at) Trace_signal(station, state, signal, at)
+#define TRACE_TRANSITION(station, from, to, at) Trace_transition(station, from, to, at)
+#define TRACE_PRINT_STATS(file) Trace_printStats(file)
+
+#else
+
+#define TRACE_SIGNAL(station, state, signal, at) ((void) 0)
+#define TRACE_TRANSITION(station, from, to, at) ((void) 0)
+#define TRACE_PRINT_STATS(file) ((void) 0)
+
+#endif
+
+#endif
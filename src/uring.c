@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "uring.h"
+
+typedef struct {
+    int fd;
+    int refs;
+    unsigned entries;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    // SQEs handed out so far, published to *sq_tail on submit
+    unsigned sqe_tail;
+    void *ring_map;
+    size_t ring_map_len;
+    size_t sqes_len;
+    bool file_used[URING_MAX_FILES];
+} Ring;
+
+static Ring ring = { .fd = -1 };
+
+static int enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t arg_len) {
+    int ret;
+
+    ret = (int) syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, arg_len);
+
+    return ret < 0 ? -errno : ret;
+}
+
+static unsigned pending(void) {
+    __atomic_store_n(ring.sq_tail, ring.sqe_tail, __ATOMIC_RELEASE);
+
+    return ring.sqe_tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+}
+
+static void submit(void) {
+    int ret;
+
+    do {
+        ret = enter(pending(), 0, 0, NULL, 0);
+    } while (ret == -EINTR);
+    if (ret < 0) fprintf(stderr, "Failed to submit io_uring requests: %s\n", strerror(-ret));
+}
+
+static bool registerSparseFiles(void) {
+    int fds[URING_MAX_FILES];
+    int i;
+
+    for (i = 0; i < URING_MAX_FILES; i++) {
+        fds[i] = -1;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds, URING_MAX_FILES) < 0) {
+        fprintf(stderr, "Failed to register io_uring file table: %s\n", strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+bool Uring_init(void) {
+    struct io_uring_params params;
+    char *sq_ring, *cq_ring;
+    unsigned *sq_array;
+    unsigned i;
+
+    if (ring.refs++ > 0) return true;
+
+    memset(&params, 0, sizeof(params));
+    // completions are only looked at from io_uring_enter anyway
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN;
+    ring.fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (ring.fd < 0 && errno == EINVAL) {
+        memset(&params, 0, sizeof(params));
+        ring.fd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    }
+    if (ring.fd < 0) {
+        fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(errno));
+        goto error;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        fprintf(stderr, "Failed to set up io_uring: the kernel is older than 5.11\n");
+        goto error_close;
+    }
+
+    ring.ring_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    if (ring.ring_map_len < params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe)) {
+        ring.ring_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    }
+    ring.ring_map = mmap(NULL, ring.ring_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ring.fd, IORING_OFF_SQ_RING);
+    if (ring.ring_map == MAP_FAILED) {
+        fprintf(stderr, "Failed to map io_uring rings: %s\n", strerror(errno));
+        goto error_close;
+    }
+    ring.sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = (struct io_uring_sqe *) mmap(NULL, ring.sqes_len, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        fprintf(stderr, "Failed to map io_uring SQEs: %s\n", strerror(errno));
+        goto error_unmap_rings;
+    }
+
+    // with IORING_FEAT_SINGLE_MMAP both rings share one mapping
+    sq_ring = (char *) ring.ring_map;
+    cq_ring = (char *) ring.ring_map;
+    ring.entries = params.sq_entries;
+    ring.sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+    ring.sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+    ring.sq_mask = *(unsigned *) (sq_ring + params.sq_off.ring_mask);
+    ring.cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+    ring.cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+    ring.cq_mask = *(unsigned *) (cq_ring + params.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+    ring.sqe_tail = *ring.sq_tail;
+
+    // SQE n always sits in slot n, only the tail moves
+    sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+    for (i = 0; i < params.sq_entries; i++) {
+        sq_array[i] = i;
+    }
+
+    if (!registerSparseFiles()) goto error_unmap_sqes;
+    memset(ring.file_used, 0, sizeof(ring.file_used));
+
+    return true;
+
+error_unmap_sqes:
+    munmap(ring.sqes, ring.sqes_len);
+
+error_unmap_rings:
+    munmap(ring.ring_map, ring.ring_map_len);
+
+error_close:
+    close(ring.fd);
+    ring.fd = -1;
+
+error:
+    ring.refs--;
+    return false;
+}
+
+void Uring_deinit(void) {
+    if (--ring.refs > 0) return;
+
+    munmap(ring.sqes, ring.sqes_len);
+    munmap(ring.ring_map, ring.ring_map_len);
+    close(ring.fd);
+    ring.fd = -1;
+}
+
+static bool updateFile(int slot, int fd) {
+    struct io_uring_files_update update = { 0 };
+
+    update.offset = slot;
+    update.fds = (uintptr_t) &fd;
+
+    return syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES_UPDATE, &update, 1) == 1;
+}
+
+int Uring_registerFile(int fd) {
+    int slot;
+
+    for (slot = 0; slot < URING_MAX_FILES; slot++) {
+        if (!ring.file_used[slot]) break;
+    }
+    if (slot == URING_MAX_FILES) return -1;
+
+    if (!updateFile(slot, fd)) {
+        fprintf(stderr, "Failed to register file with io_uring: %s\n", strerror(errno));
+        return -1;
+    }
+    ring.file_used[slot] = true;
+
+    return slot;
+}
+
+void Uring_unregisterFile(int slot) {
+    if (slot < 0) return;
+
+    // the table holds a reference that would keep the file open
+    updateFile(slot, -1);
+    ring.file_used[slot] = false;
+}
+
+bool Uring_reserve(unsigned count) {
+    if (ring.entries - pending() >= count) return true;
+
+    submit();
+
+    return ring.entries - pending() >= count;
+}
+
+struct io_uring_sqe *Uring_prep(UringOp *op, uint8_t opcode, int fd) {
+    struct io_uring_sqe *sqe;
+
+    if (!Uring_reserve(1)) return NULL;
+
+    sqe = &ring.sqes[ring.sqe_tail & ring.sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t) op;
+    ring.sqe_tail++;
+
+    return sqe;
+}
+
+void Uring_cancel(UringOp *op) {
+    struct io_uring_sqe *sqe;
+
+    // its own completion carries no op and is dropped
+    sqe = Uring_prep(NULL, IORING_OP_ASYNC_CANCEL, -1);
+    if (sqe != NULL) sqe->addr = (uintptr_t) op;
+}
+
+int Uring_wait(const struct timespec *timeout, const sigset_t *wait_mask) {
+    struct io_uring_getevents_arg arg = { 0 };
+    struct __kernel_timespec ts;
+    int ret;
+
+    if (timeout != NULL) {
+        ts.tv_sec = timeout->tv_sec;
+        ts.tv_nsec = timeout->tv_nsec;
+        arg.ts = (uintptr_t) &ts;
+    }
+    if (wait_mask != NULL) {
+        arg.sigmask = (uintptr_t) wait_mask;
+        arg.sigmask_sz = _NSIG / 8;
+    }
+
+    ret = enter(pending(), 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+
+    return ret < 0 ? ret : 0;
+}
+
+static bool collected(void **ready, int count, void *ctx) {
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (ready[i] == ctx) return true;
+    }
+
+    return false;
+}
+
+int Uring_reap(void **ready_out, int max_ready) {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    const struct io_uring_cqe *cqe;
+    UringOp *op;
+    int count = 0;
+
+    for (; head != tail; head++) {
+        cqe = &ring.cqes[head & ring.cq_mask];
+        op = (UringOp *) (uintptr_t) cqe->user_data;
+        if (op == NULL) continue;
+
+        // leave it queued for the next call rather than lose the input
+        if (ready_out != NULL && op->ctx != NULL && count == max_ready &&
+            !collected(ready_out, count, op->ctx)) break;
+
+        if (op->complete(op, cqe->res, cqe->flags) && ready_out != NULL && op->ctx != NULL &&
+            !collected(ready_out, count, op->ctx)) {
+            ready_out[count++] = op->ctx;
+        }
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+    return count;
+}
+
+void Uring_waitFor(const int *in_flight) {
+    int ret;
+
+    while (*in_flight > 0) {
+        ret = Uring_wait(NULL, NULL);
+        if (ret < 0 && ret != -EINTR) {
+            fprintf(stderr, "Failed to wait for io_uring completions: %s\n", strerror(-ret));
+            return;
+        }
+        Uring_reap(NULL, 0);
+    }
+}
@@ -0,0 +1,61 @@
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "platform.h"
+
+// A minimal io_uring on the raw syscalls, one ring per process shared by
+// the io_uring EventLoop and the devices queueing their own I/O on it.
+// Queued SQEs only reach the kernel with the next Uring_wait, so output
+// queued while handling an event goes out in the same io_uring_enter the
+// loop then sleeps in. Everything runs on the game thread.
+
+#define URING_ENTRIES 64
+#define URING_MAX_FILES 64
+
+typedef struct UringOp UringOp;
+
+// The user_data of every SQE points at one, and its completions are handed
+// back to it. Ops usually sit first in the struct they belong to.
+struct UringOp {
+    // true if the completion may have produced input for ctx
+    bool (*complete)(UringOp *op, int32_t result, uint32_t flags);
+    // handed back by waitForEvents, NULL for ops that never produce input
+    void *ctx;
+};
+
+// Counted: the ring lives until every Uring_init has its Uring_deinit.
+bool Uring_init(void);
+void Uring_deinit(void);
+// index for IOSQE_FIXED_FILE, or -1 if the table is full
+int Uring_registerFile(int fd);
+void Uring_unregisterFile(int slot);
+// flushes queued SQEs first if fewer than count are free, so a linked chain
+// can be queued without any of it being submitted early
+bool Uring_reserve(unsigned count);
+// zeroed SQE for op, NULL if the ring is full and can't be flushed
+struct io_uring_sqe *Uring_prep(UringOp *op, uint8_t opcode, int fd);
+// asks the kernel to cancel op, which then completes with -ECANCELED
+void Uring_cancel(UringOp *op);
+// Submits what is queued and sleeps until something completes or the
+// relative timeout (NULL for none) passes, with wait_mask (NULL to keep the
+// current mask) applied as with ppoll(). 0 or a negative errno, -ETIME on
+// timeout.
+int Uring_wait(const struct timespec *timeout, const sigset_t *wait_mask);
+// Runs the completions that have arrived. The ctx of ops reporting input is
+// written to ready_out, each at most once, stopping when max_ready are
+// collected; with ready_out NULL they are dropped instead. Returns the count.
+int Uring_reap(void **ready_out, int max_ready);
+// runs completions until *in_flight drops to zero
+void Uring_waitFor(const int *in_flight);
+
+// Implemented by backends built with -DPLATFORM_URING: the op a device keeps
+// armed for its own input, or NULL to have the loop poll getInputFd.
+UringOp *uringInputOp(InputDevice *dev);
+
+#endif